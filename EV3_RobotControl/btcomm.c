@@ -45,6 +45,21 @@ int message_id_counter =
         //     messages sent to the EV3
 int *socket_id;  // <-- Socked identifier for your EV3
 
+int (*BT_write_hook)(const void *buf, int len) = NULL;
+int (*BT_read_hook)(void *buf, int len) = NULL;
+
+static int BT_write(const void *buf, int len) {
+  // Send a command string to the EV3, or to the transport hook if one is set
+  if (BT_write_hook != NULL) return BT_write_hook(buf, len);
+  return write(*socket_id, buf, len);
+}
+
+static int BT_read(void *buf, int len) {
+  // Read a reply from the EV3, or from the transport hook if one is set
+  if (BT_read_hook != NULL) return BT_read_hook(buf, len);
+  return read(*socket_id, buf, len);
+}
+
 int BT_open(const char *device_id) {
   //////////////////////////////////////////////////////////////////////////////////////////////////////
   // Open a socket to the specified Lego EV3 device specified by the provided
@@ -82,6 +97,91 @@ int BT_open(const char *device_id) {
   return 0;
 }
 
+int BT_open_wifi(const char *device_id) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Open a connection to the specified Lego EV3 over WiFi, for a brick with a
+  // WiFi dongle on the same network as the PC. The rest of the API works the
+  // same as over Bluetooth.
+  //
+  // The brick announces itself every few seconds with a UDP broadcast to
+  // port 3015 that carries its serial number, which is its Bluetooth address
+  // without the colons. Answering the broadcast unlocks its TCP port, and the
+  // connection is opened with a VMTP handshake.
+  //
+  // Input: The hex string identifier for the Lego EV3 block
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  struct timeval timeout = {15, 0};
+  char serial[13], beacon[256], request[128], reply[128];
+  char *field;
+  int udp, port = 5555, one = 1, i, j, n;
+
+  for (i = 0, j = 0; device_id[i] != '\0' && j < 12; i++)
+    if (device_id[i] != ':') serial[j++] = tolower(device_id[i]);
+  serial[j] = '\0';
+  fprintf(stderr, "Request to connect to device %s over WiFi\n", device_id);
+
+  udp = socket(AF_INET, SOCK_DGRAM, 0);
+  setsockopt(udp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(3015);
+  if (bind(udp, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("BT_open_wifi: Cannot listen for EV3 broadcasts ");
+    close(udp);
+    return (-1);
+  }
+  while (1) {
+    n = recvfrom(udp, beacon, sizeof(beacon) - 1, 0, (struct sockaddr *)&addr,
+                 &addr_len);
+    if (n < 0) {
+      fprintf(stderr, "BT_open_wifi: EV3 %s not found on the network\n",
+              device_id);
+      close(udp);
+      return (-1);
+    }
+    beacon[n] = '\0';
+    for (i = 0; i < n; i++) beacon[i] = tolower(beacon[i]);
+    if (strstr(beacon, serial) != NULL) break;
+  }
+  if ((field = strstr(beacon, "port: ")) != NULL) sscanf(field + 6, "%d", &port);
+  sendto(udp, " ", 1, 0, (struct sockaddr *)&addr, addr_len);
+  close(udp);
+
+  socket_id = (int *)malloc(sizeof(int));
+  *socket_id = socket(AF_INET, SOCK_STREAM, 0);
+  addr.sin_port = htons(port);
+  if (connect(*socket_id, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("Connection attempt failed ");
+    close(*socket_id);
+    free(socket_id);
+    socket_id = NULL;
+    return (-1);
+  }
+  n = snprintf(request, sizeof(request),
+               "GET /target?sn=%s VMTP1.0\r\nProtocol: EV3\r\n\r\n", serial);
+  write(*socket_id, request, n);
+  n = read(*socket_id, reply, sizeof(reply) - 1);
+  reply[n > 0 ? n : 0] = '\0';
+  if (strstr(reply, "Accept:EV340") == NULL) {
+    fprintf(stderr, "BT_open_wifi: EV3 %s refused the connection\n",
+            device_id);
+    close(*socket_id);
+    free(socket_id);
+    socket_id = NULL;
+    return (-1);
+  }
+  printf("Connection to %s established at %s, socket: %d.\n", device_id,
+         inet_ntoa(addr.sin_addr), *socket_id);
+  return 0;
+}
+
 int BT_close() {
   /////////////////////////////////////////////////////////////////////////////////////////////////////
   // Close the communication socket to the EV3
@@ -146,8 +246,8 @@ int BT_setEV3name(const char *name) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], len + 2);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], len + 2);
+  BT_read(&reply[0], 1023);
 
 #ifdef __BT_debug
   fprintf(stderr, "Set name reply:\n");
@@ -272,16 +372,16 @@ int BT_play_tone_sequence(const int tone_data[50][3]) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], len + 2);
+  BT_write(&cmd_string[0], len + 2);
 
-  read(*socket_id, &reply[0], 1023);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
   return (0);
 }
 
-int BT_motor_port_start(char port_ids, char power) {
+int BT_motor_port_start_layer(char layer, char port_ids, char power) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // This function sends a command to the specified motor ports to set the motor
@@ -329,11 +429,18 @@ int BT_motor_port_start(char port_ids, char power) {
     return (0);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_motor_port_start: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
+  cmd_string[13] = layer;
 
   cmd_string[9] = port_ids;
   cmd_string[11] = power;
@@ -347,8 +454,8 @@ int BT_motor_port_start(char port_ids, char power) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -363,7 +470,12 @@ int BT_motor_port_start(char port_ids, char power) {
   return (0);
 }
 
-int BT_motor_port_stop(char port_ids, int brake_mode) {
+int BT_motor_port_start(char port_ids, char power) {
+  // The same on the brick the PC is connected to
+  return BT_motor_port_start_layer(LAYER_1, port_ids, power);
+}
+
+int BT_motor_port_stop_layer(char layer, char port_ids, int brake_mode) {
   //////////////////////////////////////////////////////////////////////////////////
   // Stop the motor(s) at the specified ports. This does not change the output
   // power settings!
@@ -390,11 +502,17 @@ int BT_motor_port_stop(char port_ids, int brake_mode) {
     return (0);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_motor_port_stop: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
 
   cmd_string[9] = port_ids;
   cmd_string[10] = brake_mode;
@@ -407,8 +525,8 @@ int BT_motor_port_stop(char port_ids, int brake_mode) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 11);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 11);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -424,7 +542,12 @@ int BT_motor_port_stop(char port_ids, int brake_mode) {
   return (0);
 }
 
-int BT_all_stop(int brake_mode) {
+int BT_motor_port_stop(char port_ids, int brake_mode) {
+  // The same on the brick the PC is connected to
+  return BT_motor_port_stop_layer(LAYER_1, port_ids, brake_mode);
+}
+
+int BT_all_stop_layer(char layer, int brake_mode) {
   //////////////////////////////////////////////////////////////////////////////////////////////////////
   // Stops all motor ports - provided for convenience, of course you can do the
   // same with the functions above.
@@ -443,11 +566,17 @@ int BT_all_stop(int brake_mode) {
   //                           |length-2| | cnt_id | |type| | header |  |stop|
   //                           |layer|  |port ids|  |brake|
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_all_stop: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
 
   cmd_string[9] = port_ids;
   cmd_string[10] = brake_mode;
@@ -460,8 +589,8 @@ int BT_all_stop(int brake_mode) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 11);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 11);
+  BT_read(&reply[0], 1023);
   message_id_counter++;
 
   if (reply[4] == 0x02) {
@@ -476,7 +605,12 @@ int BT_all_stop(int brake_mode) {
   return (0);
 }
 
-int BT_drive(char lport, char rport, char power) {
+int BT_all_stop(int brake_mode) {
+  // The same on the brick the PC is connected to
+  return BT_all_stop_layer(LAYER_1, brake_mode);
+}
+
+int BT_drive_layer(char layer, char lport, char rport, char power) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   // This function sends a command to the left and right motor ports to set the
   // motor power to the desired value. You can drive forward or backward
@@ -525,11 +659,18 @@ int BT_drive(char lport, char rport, char power) {
   }
   ports = lport | rport;
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_drive: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
+  cmd_string[13] = layer;
 
   cmd_string[9] = ports;
   cmd_string[11] = power;
@@ -543,8 +684,8 @@ int BT_drive(char lport, char rport, char power) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -560,7 +701,12 @@ int BT_drive(char lport, char rport, char power) {
   return (0);
 }
 
-int BT_turn(char lport, char lpower, char rport, char rpower) {
+int BT_drive(char lport, char rport, char power) {
+  // The same on the brick the PC is connected to
+  return BT_drive_layer(LAYER_1, lport, rport, power);
+}
+
+int BT_turn_layer(char layer, char lport, char lpower, char rport, char rpower) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // This function sends a command to the left and right motor ports to set the
@@ -610,11 +756,19 @@ int BT_turn(char lport, char lpower, char rport, char rpower) {
     return (-1);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_turn: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
+  cmd_string[13] = layer;
+  cmd_string[18] = layer;
 
   // set up power and port for left motor
   cmd_string[9] = lport;
@@ -634,8 +788,8 @@ int BT_turn(char lport, char lpower, char rport, char rpower) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 20);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 20);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -651,8 +805,13 @@ int BT_turn(char lport, char lpower, char rport, char rpower) {
   return (0);
 }
 
-int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
-                              int run_time, int ramp_down_time) {
+int BT_turn(char lport, char lpower, char rport, char rpower) {
+  // The same on the brick the PC is connected to
+  return BT_turn_layer(LAYER_1, lport, lpower, rport, rpower);
+}
+
+int BT_timed_motor_port_start_layer(char layer, char port_id, char power, int ramp_up_time,
+                                    int run_time, int ramp_down_time) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // Provides timed operation of the motor ports. This allows you, for example,
@@ -696,11 +855,17 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
     return (-1);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_timed_motor_port_start: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
 
   cmd_string[0] = LC0(20);
   cmd_string[7] = opOUTPUT_TIME_POWER;
@@ -725,8 +890,8 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 22);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 22);
+  BT_read(&reply[0], 1023);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -750,6 +915,13 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
   return (0);
 }
 
+int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
+                              int run_time, int ramp_down_time) {
+  // The same on the brick the PC is connected to
+  return BT_timed_motor_port_start_layer(LAYER_1, port_id, power, ramp_up_time, run_time,
+                                         ramp_down_time);
+}
+
 int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
@@ -825,8 +997,8 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd[0], 26);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd[0], 26);
+  BT_read(&reply[0], 1023);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -884,8 +1056,8 @@ void BT_get_type_mode(char sensor_port) {
   }
   fprintf(stderr, "\n");
 
-  write(*socket_id, &cmd_string[0], 13);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 13);
+  BT_read(&reply[0], 1023);
 
   fprintf(stderr, "BT_get_type_mode response string:\n");
   for (int i = 0; i < 7; i++) {
@@ -898,7 +1070,7 @@ void BT_get_type_mode(char sensor_port) {
   message_id_counter++;
 }
 
-int BT_read_touch_sensor(char sensor_port) {
+int BT_read_touch_sensor_layer(char layer, char sensor_port) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   // Reads the value from the touch sensor.
   //
@@ -925,11 +1097,17 @@ int BT_read_touch_sensor(char sensor_port) {
     return (-1);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_read_touch_sensor: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[9] = layer;
 
   cmd_string[7] = opINPUT_DEVICE;
   cmd_string[8] = LC0(READY_PCT);
@@ -946,8 +1124,8 @@ int BT_read_touch_sensor(char sensor_port) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -962,7 +1140,12 @@ int BT_read_touch_sensor(char sensor_port) {
   }
 }
 
-int BT_read_colour_sensor(char sensor_port) {
+int BT_read_touch_sensor(char sensor_port) {
+  // The same on the brick the PC is connected to
+  return BT_read_touch_sensor_layer(LAYER_1, sensor_port);
+}
+
+int BT_read_colour_sensor_layer(char layer, char sensor_port) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // Reads the value from the colour sensor using the indexed colour method
@@ -1005,11 +1188,17 @@ int BT_read_colour_sensor(char sensor_port) {
     return (-1);
   }
 
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_read_colour_sensor: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[9] = layer;
 
   cmd_string[7] = opINPUT_DEVICE;
   cmd_string[8] = LC0(READY_RAW);
@@ -1027,8 +1216,8 @@ int BT_read_colour_sensor(char sensor_port) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1042,7 +1231,12 @@ int BT_read_colour_sensor(char sensor_port) {
   return reply[5];
 }
 
-int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
+int BT_read_colour_sensor(char sensor_port) {
+  // The same on the brick the PC is connected to
+  return BT_read_colour_sensor_layer(LAYER_1, sensor_port);
+}
+
+int BT_read_colour_sensor_RGB_layer(char layer, char sensor_port, int RGB[3]) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // Reads the value from the colour sensor returning an RGB colour triplet.
@@ -1086,11 +1280,17 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
   }
 
   cmd_string[0] = LC0(15);
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_read_colour_sensor_RGB: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[9] = layer;
 
   cmd_string[7] = opINPUT_DEVICE;
   cmd_string[8] = LC0(READY_RAW);
@@ -1110,8 +1310,8 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 17);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 17);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1159,7 +1359,12 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
   return (0);
 }
 
-int BT_read_ultrasonic_sensor(char sensor_port) {
+int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
+  // The same on the brick the PC is connected to
+  return BT_read_colour_sensor_RGB_layer(LAYER_1, sensor_port, RGB);
+}
+
+int BT_read_ultrasonic_sensor_layer(char layer, char sensor_port) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // Reads the value from ultrasonic sensor and returns distance in mm to any
@@ -1190,11 +1395,17 @@ int BT_read_ultrasonic_sensor(char sensor_port) {
   }
 
   cmd_string[0] = LC0(13);
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_read_ultrasonic_sensor: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[9] = layer;
 
   cmd_string[7] = opINPUT_DEVICE;
   cmd_string[8] = LC0(READY_RAW);
@@ -1211,8 +1422,8 @@ int BT_read_ultrasonic_sensor(char sensor_port) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1227,7 +1438,12 @@ int BT_read_ultrasonic_sensor(char sensor_port) {
   return (reply[5]);
 }
 
-int BT_read_gyro_sensor(char sensor_port) {
+int BT_read_ultrasonic_sensor(char sensor_port) {
+  // The same on the brick the PC is connected to
+  return BT_read_ultrasonic_sensor_layer(LAYER_1, sensor_port);
+}
+
+int BT_read_gyro_sensor_layer(char layer, char sensor_port) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
   // Returns the relative angle. Note that the sensor is initialized when you
@@ -1262,11 +1478,17 @@ int BT_read_gyro_sensor(char sensor_port) {
   }
 
   cmd_string[0] = LC0(13);
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "BT_read_gyro_sensor: Invalid layer\n");
+    return (-1);
+  }
+
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
+  cmd_string[8] = layer;
 
   cmd_string[7] = opINPUT_READEXT;
   cmd_string[9] = sensor_port;
@@ -1284,8 +1506,8 @@ int BT_read_gyro_sensor(char sensor_port) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 15);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1335,6 +1557,11 @@ int BT_read_gyro_sensor(char sensor_port) {
   return (angle);
 }
 
+int BT_read_gyro_sensor(char sensor_port) {
+  // The same on the brick the PC is connected to
+  return BT_read_gyro_sensor_layer(LAYER_1, sensor_port);
+}
+
 int BT_play_sound_file(const char *path, int volume) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
@@ -1387,8 +1614,8 @@ int BT_play_sound_file(const char *path, int volume) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 12 + path_len + 1);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 12 + path_len + 1);
+  BT_read(&reply[0], 1023);
   message_id_counter++;
 
   if (reply[4] == 0x02) {
@@ -1411,95 +1638,88 @@ int BT_play_sound_file(const char *path, int volume) {
   return (0);
 }
 
-// TODO: add the ability to read long directories that cannot be finished in one
-// read
-int BT_list_files(char *path, char **msg_reply) {
+int BT_sound_break(void) {
   ////////////////////////////////////////////////////////////////////////////////////////////////
   //
-  // Reads the directory contents at the null-terminated path.
+  // Stops the sound that is currently playing, if any. Useful to cut a sound
+  // file short before playing another one.
   //
-  // Inputs: path - null-terminated path, with maximum length of 1012 bytes
-  // including the nullbyte
-  //         msg_reply - memory will be allocated by list_files to hold the
-  //         response, the response string contains subdirectories/files
-  //         specified by path delimeted by '\n' the calling code is responsible
-  //         for freeing the memory from msg_reply
-  //
-  // Returns: success code on successfull execution
-  //          error code on error
+  // Returns: 0 on success
+  //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
 
   void *p;
-  int i;
   char reply[1024];
-  memset(reply, 0, 1024);
+  memset(&reply[0], 0, 1024);
   unsigned char *cp;
-  unsigned int msg_length = 0;
-  int path_len = 0;
-  path_len = strnlen(path, 1011);
-  unsigned char cmd_string[1024];
-  memset(cmd_string, 0, 1024);
+  unsigned char cmd_string[9] = {0x07, 0x00, 0x00, 0x00, 0x00,
+                                 0x00, 0x00, 0x00, 0x00};
+  //                          |length-2| | cnt_id | |type| | header |   |cmd|
+  //                          |sound cmd|
 
-  cmd_string[0] = LX_byte1(8 + path_len - 2 + 1);  // length-2
-  cmd_string[1] = LX_byte2(8 + path_len - 2 + 1);  // length-2
   // Set message count id
   p = (void *)&message_id_counter;
   cp = (unsigned char *)p;
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
 
-  cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
-  cmd_string[5] = LIST_FILES;            // system_cmd
-  cmd_string[6] = LX_byte1(1012);        // max bytes to read
-  cmd_string[7] = LX_byte2(1012);
-  for (i = 0; i < path_len; i++) {
-    cmd_string[i + 8] = path[i];
-  }
-  cmd_string[8 + path_len] = '\0';
+  cmd_string[7] = opSOUND;
+  cmd_string[8] = BREAK;
 
 #ifdef __BT_debug
-  fprintf(stderr, "BT_list_files command string\n");
-  for (i = 0; i < 8 + path_len + 1; i++) {
+  fprintf(stderr, "BT_sound_break command string\n");
+  for (int i = 0; i < 9; i++) {
     fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
   }
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 8 + path_len + 1);
-  read(*socket_id, &reply, 1023);
-
+  BT_write(&cmd_string[0], 9);
+  BT_read(&reply[0], 1023);
   message_id_counter++;
 
-  if (reply[4] == SYSTEM_REPLY) {
-    msg_length |= (unsigned char)reply[1];
-    msg_length <<= 8;
-    msg_length |= (unsigned char)reply[0];
-    msg_length += 2;
+  if (reply[4] == 0x02) {
 #ifdef __BT_debug
-    fprintf(stderr, "BT_list_files(): Command successful\n");
-    fprintf(stderr, "BT_list_files response string:\n");
-    for (int i = 0; i < msg_length; i++) {
-      fprintf(stderr, "%X, ", reply[i] & 0xff);
-    }
-    fprintf(stderr, "\n");
+    fprintf(stderr, "BT_sound_break(): Command successful\n");
 #endif
-    *msg_reply = (char *)calloc(msg_length - 11, sizeof(char));
-    if (*msg_reply == NULL) {
-      perror("calloc");
-      return (-1);
-    }
+  } else {
+    fprintf(stderr, "BT_sound_break: Command failed\n");
+    return (-1);
+  }
+  return (0);
+}
 
-    if (reply[6] == SUCCESS || reply[6] == END_OF_FILE) {
-      strncpy(*msg_reply, &reply[12], msg_length - 11);
-    } else {
-      return reply[6];
-    }
-    fprintf(stderr, "\n");
+int BT_list_files(char *path, char **msg_reply) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Reads the directory contents at the null-terminated path. Listings
+  // longer than one reply are read to the end with CONTINUE_LIST_FILES.
+  //
+  // Inputs: path - null-terminated path, with maximum length of 1012 bytes
+  // including the nullbyte
+  //         msg_reply - memory will be allocated by list_files to hold the
+  //         response, the response string contains subdirectories/files
+  //         specified by path delimeted by '\n' the calling code is responsible
+  //         for freeing the memory from msg_reply
+  //
+  // Returns: success code on successfull execution
+  //          error code on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_batch batch;
+  int status;
+
+  BT_batch_init(&batch);
+  if (BT_batch_list_files(&batch, path) < 0) return (-1);
+  status = BT_batch_run(&batch, 1) < 0 ? -1 : batch.ops[0].status;
+  if (status == SUCCESS || status == END_OF_FILE) {
+    *msg_reply = batch.ops[0].reply;
+    batch.ops[0].reply = NULL;
+    if (*msg_reply == NULL) status = -1;
   } else {
     fprintf(stderr, "BT_list_files: Command failed\n");
-    return (reply[4]);
   }
-  return (reply[6]);
+  BT_batch_free(&batch);
+  return (status);
 }
 
 int BT_upload_file(char const *dest, char const *src) {
@@ -1522,26 +1742,41 @@ int BT_upload_file(char const *dest, char const *src) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_upload upload;
+  int status;
+
+  status = BT_upload_begin(&upload, dest, src);
+  while (status == SUCCESS && upload.left > 0)
+    status = BT_upload_next(&upload);
+  BT_upload_end(&upload);
+  return (status);
+}
 
-  FILE *fp;
+int BT_upload_begin(struct BT_upload *upload, char const *dest,
+                    char const *src) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Start uploading the file at src on the PC to dest on EV3 brick, as in
+  // BT_upload_file(). The data is then sent one chunk per BT_upload_next()
+  // call, so a program can spread an upload over its control loop.
+  //
+  // Returns: success code on successfull execution
+  //          error code on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
   void *p;
-  char buffer[PARTITION_SIZE];
-  int i, size, remainder, n;
+  int i, path_len;
   char reply[1024];
   memset(&reply[0], 0, 1024);
   unsigned char *cp;
   const char *p1 = "/home/root/lms2012/apps";
   const char *p2 = "/home/root/lms2012/prjs";
   const char *p3 = "/home/root/lms2012/tools";
-
-  int path_len = 0;
-  unsigned int msg_length = 0;
-  int handle;
-
   unsigned char cmd_string[1024];
   memset(&cmd_string[0], 0, 1024);
   struct stat st;
 
+  upload->fp = NULL;
+  upload->left = 0;
   if ((dest[0] == '/') && (strncmp(p1, dest, strlen(p1)) != 0) &&
       (strncmp(p2, dest, strlen(p2)) != 0) &&
       (strncmp(p3, dest, strlen(p3)) != 0)) {
@@ -1551,12 +1786,13 @@ int BT_upload_file(char const *dest, char const *src) {
         "/home/root/lms2012/prjs or /home/root/lms2012/tools\n");
     return (-1);
   }
+  if (stat(src, &st) != 0 || (upload->fp = fopen(src, "rb")) == NULL) {
+    perror(src);
+    return (-1);
+  }
+  upload->left = st.st_size;
 
   path_len = strnlen(dest, 1011);
-
-  stat(src, &st);
-  size = st.st_size;
-
   cmd_string[0] = LX_byte1(10 + path_len - 2 + 1);  // length-2
   cmd_string[1] = LX_byte2(10 + path_len - 2 + 1);  // length-2
   // Set message count id
@@ -1565,128 +1801,643 @@ int BT_upload_file(char const *dest, char const *src) {
   cmd_string[2] = *cp;
   cmd_string[3] = *(cp + 1);
 
-  cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
-  cmd_string[5] = BEGIN_DOWNLOAD;        // system_cmd
-  cmd_string[6] = LX_byte1(size);        // file size
-  cmd_string[7] = LX_byte2(size);
-  cmd_string[8] = LX_byte3(size);
-  cmd_string[9] = LX_byte4(size);
+  cmd_string[4] = SYSTEM_COMMAND_REPLY;   // type
+  cmd_string[5] = BEGIN_DOWNLOAD;         // system_cmd
+  cmd_string[6] = LX_byte1(upload->left);  // file size
+  cmd_string[7] = LX_byte2(upload->left);
+  cmd_string[8] = LX_byte3(upload->left);
+  cmd_string[9] = LX_byte4(upload->left);
   for (i = 0; i < path_len; i++) {
     cmd_string[i + 10] = dest[i];
   }
   cmd_string[10 + path_len] = '\0';
 
 #ifdef __BT_debug
-  fprintf(stderr, "BT_upload_file command string\n");
+  fprintf(stderr, "BT_upload_begin command string\n");
   for (i = 0; i < 10 + path_len + 1; i++) {
     fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
   }
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0],
-        10 + path_len + 1);  // this will return a handle to the file
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0],
+           10 + path_len + 1);  // this will return a handle to the file
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
-  if (reply[4] == SYSTEM_REPLY) {
-    msg_length = (unsigned char)reply[1];
-    msg_length <<= 8;
-    msg_length |= (unsigned char)reply[0];
-    msg_length += 2;
-#ifdef __BT_debug
-    fprintf(stderr, "BT_upload_file response string:\n");
-    for (int i = 0; i < msg_length; i++) {
-      fprintf(stderr, "%X, ", reply[i] & 0xff);
-    }
-    fprintf(stderr, "\n");
-#endif
-    if (reply[6] == SUCCESS) {
-      fprintf(stderr, "BT_upload_file(): Command successful\n");
-      handle = reply[8];
-    } else {
-      return reply[6];
-    }
-    fprintf(stderr, "\n");
-  } else {
+  if (reply[4] != SYSTEM_REPLY) {
     fprintf(stderr, "BT_upload_file: Command failed\n");
+    BT_upload_end(upload);
     return (reply[4]);
   }
+  if (reply[6] != SUCCESS) {
+    BT_upload_end(upload);
+    return reply[6];
+  }
+  fprintf(stderr, "BT_upload_file(): Command successful\n");
+  upload->handle = (unsigned char)reply[7];
+  return (SUCCESS);
+}
 
-  if ((fp = fopen(src, "rb")) == NULL) {
-    perror(src);
+int BT_upload_next(struct BT_upload *upload) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Send the next chunk of at most PARTITION_SIZE bytes of an upload started
+  // with BT_upload_begin(). upload->left is 0 once all the data is sent.
+  //
+  // Returns: success code, or END_OF_FILE after the last chunk
+  //          error code on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  void *p;
+  unsigned char *cp;
+  char reply[1024];
+  memset(&reply[0], 0, 1024);
+  unsigned char cmd_string[1024];
+  memset(&cmd_string[0], 0, 1024);
+  int remainder;
+
+  if (upload->fp == NULL) return (-1);
+  remainder = upload->left > PARTITION_SIZE ? PARTITION_SIZE : upload->left;
+  if (fread(&cmd_string[7], 1, remainder, upload->fp) != (size_t)remainder) {
+    perror("BT_upload_next");
     return (-1);
   }
+  cmd_string[0] = LX_byte1(7 + remainder - 2);  // length-2
+  cmd_string[1] = LX_byte2(7 + remainder - 2);  // length-2
+  // Set message count id
+  p = (void *)&message_id_counter;
+  cp = (unsigned char *)p;
+  cmd_string[2] = *cp;
+  cmd_string[3] = *(cp + 1);
 
-  remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
-  while (remainder > 0) {
-    memset(&cmd_string[0], 0, 1024);
+  cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
+  cmd_string[5] = CONTINUE_DOWNLOAD;     // system_cmd
+  cmd_string[6] = (unsigned char)LX_byte1(upload->handle);  // handle
 
-    n = fread(buffer, 1, remainder, fp);
-    cmd_string[0] = LX_byte1(7 + remainder - 2);  // length-2
-    cmd_string[1] = LX_byte2(7 + remainder - 2);  // length-2
-    // Set message count id
-    p = (void *)&message_id_counter;
-    cp = (unsigned char *)p;
-    cmd_string[2] = *cp;
-    cmd_string[3] = *(cp + 1);
-
-    cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
-    cmd_string[5] = CONTINUE_DOWNLOAD;     // system_cmd
-    cmd_string[6] = LX_byte1(handle);      // handle
-    for (i = 0; i < remainder; i++) {
-      cmd_string[i + 7] = buffer[i];
-    }
+#ifdef __BT_debug
+  fprintf(stderr, "BT_upload_next command string\n");
+  for (int i = 0; i < 7 + remainder; i++) {
+    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  }
+  fprintf(stderr, "\n");
+#endif
 
+  BT_write(&cmd_string[0], 7 + remainder);
+  BT_read(&reply[0], 1023);
+
+  message_id_counter++;
+
+  if (reply[4] != SYSTEM_REPLY) {
 #ifdef __BT_debug
-    fprintf(stderr, "BT_upload_file command string\n");
-    for (i = 0; i < 7 + remainder; i++) {
-      fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-    }
-    fprintf(stderr, "\n");
+    fprintf(stderr, "BT_upload_file: Command failed\n");
 #endif
+    return (reply[4]);
+  }
+  if (reply[6] != SUCCESS && reply[6] != END_OF_FILE) return reply[6];
+  upload->left -= remainder;
+  return (reply[6]);
+}
+
+void BT_upload_end(struct BT_upload *upload) {
+  if (upload->fp != NULL) fclose(upload->fp);
+  upload->fp = NULL;
+}
+
+// Replies not yet handed out by BT_read_reply(), in case one read returned
+// more than a single reply
+static unsigned char reply_stash[4096];
+static int reply_stash_len = 0;
+
+static int BT_read_reply(char *reply, int max) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Read exactly one reply from the EV3, however the replies are split across
+  // reads. Returns the reply length, or -1 if the link is lost or the reply
+  // does not fit in max bytes.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int n, len;
+
+  while (reply_stash_len < 2 ||
+         reply_stash_len < 2 + (reply_stash[0] | reply_stash[1] << 8)) {
+    n = BT_read(&reply_stash[reply_stash_len],
+                sizeof(reply_stash) - reply_stash_len);
+    if (n <= 0) return (-1);
+    reply_stash_len += n;
+  }
+  len = 2 + (reply_stash[0] | reply_stash[1] << 8);
+  if (len > max) return (-1);
+  memcpy(reply, reply_stash, len);
+  memmove(reply_stash, &reply_stash[len], reply_stash_len - len);
+  reply_stash_len -= len;
+  return (len);
+}
+
+void BT_batch_init(struct BT_batch *batch) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Start an empty batch of system commands.
+  //
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  batch->ops = NULL;
+  batch->cnt = 0;
+  batch->max = 0;
+}
+
+static int BT_batch_add(struct BT_batch *batch, unsigned char system_cmd,
+                        const unsigned char *params, int params_len) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Queue a system command with the given parameter bytes. The message
+  // counter is filled in when the command is sent. Returns the index of the
+  // operation, or -1 on error.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_batch_op *op;
+  void *p;
+
+  if (batch->cnt == batch->max) {
+    batch->max = batch->max == 0 ? 64 : 2 * batch->max;
+    p = realloc(batch->ops, batch->max * sizeof(struct BT_batch_op));
+    if (p == NULL) {
+      perror("realloc");
+      return (-1);
+    }
+    batch->ops = (struct BT_batch_op *)p;
+  }
+  op = &batch->ops[batch->cnt];
+  op->len = 6 + params_len;
+  op->cmd = (unsigned char *)calloc(op->len, sizeof(unsigned char));
+  if (op->cmd == NULL) {
+    perror("calloc");
+    return (-1);
+  }
+  op->cmd[0] = LX_byte1(op->len - 2);  // length-2
+  op->cmd[1] = LX_byte2(op->len - 2);
+  op->cmd[4] = SYSTEM_COMMAND_REPLY;  // type
+  op->cmd[5] = system_cmd;
+  if (params_len > 0) memcpy(&op->cmd[6], params, params_len);
+  op->id = -1;
+  op->status = -1;
+  op->reply = NULL;
+  op->reply_len = 0;
+  op->list_left = 0;
+  return (batch->cnt++);
+}
+
+static int BT_batch_add_path(struct BT_batch *batch, unsigned char system_cmd,
+                             const unsigned char *prefix, int prefix_len,
+                             const char *path) {
+  // Queue a system command whose parameters end in a null-terminated path,
+  // truncated at 1011 bytes like the other system commands
+  unsigned char params[1024];
+  int path_len = strnlen(path, 1011);
+
+  if (prefix_len > 0) memcpy(params, prefix, prefix_len);
+  memcpy(&params[prefix_len], path, path_len);
+  params[prefix_len + path_len] = '\0';
+  return BT_batch_add(batch, system_cmd, params, prefix_len + path_len + 1);
+}
+
+int BT_batch_list_files(struct BT_batch *batch, const char *path) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Queue reading the directory contents at path. After BT_batch_run() the
+  // operation's reply holds the whole null-terminated listing, as returned
+  // by BT_list_files().
+  //
+  // Returns: the index of the operation, or -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char max_bytes[2] = {LX_byte1(1012), LX_byte2(1012)};
+  return BT_batch_add_path(batch, LIST_FILES, max_bytes, 2, path);
+}
+
+int BT_batch_delete_file(struct BT_batch *batch, const char *path) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Queue deleting the file or empty directory at path.
+  //
+  // Returns: the index of the operation, or -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  return BT_batch_add_path(batch, DELETE_FILE, NULL, 0, path);
+}
+
+int BT_batch_create_dir(struct BT_batch *batch, const char *path) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Queue creating the directory at path.
+  //
+  // Returns: the index of the operation, or -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  return BT_batch_add_path(batch, CREATE_DIR, NULL, 0, path);
+}
+
+int BT_batch_close_handle(struct BT_batch *batch, int handle) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Queue closing a file handle left open on the EV3, for example by an
+  // upload that was interrupted.
+  //
+  // Returns: the index of the operation, or -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char params[1] = {(unsigned char)LX_byte1(handle)};
+  return BT_batch_add(batch, CLOSE_FILEHANDLE, params, 1);
+}
 
-    write(*socket_id, &cmd_string[0], 7 + remainder);
-    read(*socket_id, &reply[0], 1023);
+int BT_batch_list_handles(struct BT_batch *batch) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Queue listing the open file handles. After BT_batch_run() the operation's
+  // reply holds a bit field with one bit per handle, set if it is open.
+  //
+  // Returns: the index of the operation, or -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  return BT_batch_add(batch, LIST_OPEN_HANDLES, NULL, 0);
+}
 
-    message_id_counter++;
+int BT_batch_run(struct BT_batch *batch, int window) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Send the queued operations, keeping up to window of them in flight. Each
+  // reply is matched to its operation by the message counter, and sets the
+  // operation's status (SUCCESS, END_OF_FILE or an error code) and reply.
+  // The EV3 runs the commands in the order they were queued, so a batch such
+  // as "create a directory, then upload into it" is safe.
+  //
+  // Inputs: window - the number of operations sent ahead of their replies,
+  //         BT_BATCH_WINDOW is a good default for Bluetooth
+  //
+  // Returns: the number of operations that failed
+  //          -1 if the link was lost, in which case the operations not yet
+  //          answered keep status -1
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_batch_op *op;
+  char reply[sizeof(reply_stash)];
+  unsigned char cont[9];
+  int next = 0, first = 0, in_flight = 0, failed = 0;
+  int i, id, len, offset;
+  void *p;
 
-    if (reply[4] == SYSTEM_REPLY) {
-      msg_length = (unsigned char)reply[1];
-      msg_length <<= 8;
-      msg_length |= (unsigned char)reply[0];
-      msg_length += 2;
+  if (window < 1) window = 1;
+  while (first < batch->cnt) {
+    while (in_flight < window && next < batch->cnt) {
+      op = &batch->ops[next++];
+      op->id = message_id_counter & 0xFFFF;
+      op->cmd[2] = LX_byte1(op->id);
+      op->cmd[3] = LX_byte2(op->id);
+      message_id_counter++;
 #ifdef __BT_debug
-      fprintf(stderr, "BT_upload_file response string:\n");
-      for (int i = 0; i < msg_length; i++) {
-        fprintf(stderr, "%X, ", reply[i] & 0xff);
+      fprintf(stderr, "BT_batch_run command string\n");
+      for (i = 0; i < op->len; i++) {
+        fprintf(stderr, "%X, ", op->cmd[i] & 0xff);
       }
       fprintf(stderr, "\n");
 #endif
-      if (reply[6] == SUCCESS) {
-#ifdef __BT_debug
-        fprintf(stderr, "BT_upload_file(): Command successful\n");
-#endif
-      } else if (reply[6] == END_OF_FILE) {
-#ifdef __BT_debug
-        fprintf(stderr, "BT_upload_file(): Command completed\n");
-#endif
+      BT_write(op->cmd, op->len);
+      in_flight++;
+    }
+
+    len = BT_read_reply(reply, sizeof(reply));
+    if (len < 0) {
+      fprintf(stderr, "BT_batch_run: Link lost with %d operations unanswered\n",
+              batch->cnt - first);
+      return (-1);
+    }
+    id = (unsigned char)reply[2] | (unsigned char)reply[3] << 8;
+    for (i = first; i < next; i++)
+      if (batch->ops[i].status == -1 && batch->ops[i].id == id) break;
+    if (i == next) continue;  // A late reply to an earlier command
+
+    op = &batch->ops[i];
+    in_flight--;
+    if (len < 7 ||
+        (reply[4] != SYSTEM_REPLY && reply[4] != SYSTEM_REPLY_ERROR)) {
+      op->status = UNKNOWN_ERROR;
+    } else if ((unsigned char)reply[5] == CONTINUE_LIST_FILES) {
+      // The next part of a listing, after the status and handle
+      op->status = (unsigned char)reply[6];
+      len = len > 8 ? len - 8 : 0;
+      p = realloc(op->reply, op->reply_len + len + 1);
+      if (p == NULL) {
+        perror("realloc");
+        op->status = UNKNOWN_ERROR;
       } else {
-        return reply[6];
+        op->reply = (char *)p;
+        memcpy(&op->reply[op->reply_len], &reply[8], len);
+        op->reply_len += len;
+        op->reply[op->reply_len] = '\0';
+        op->list_left -= len;
       }
-      fprintf(stderr, "\n");
     } else {
+      op->status = (unsigned char)reply[6];
+      // LIST_FILES replies carry the list size and a handle before the data
+      offset = op->cmd[5] == LIST_FILES ? 12 : 7;
+      if (op->cmd[5] == LIST_FILES || op->cmd[5] == LIST_OPEN_HANDLES) {
+        op->reply_len = len > offset ? len - offset : 0;
+        op->reply = (char *)calloc(op->reply_len + 1, sizeof(char));
+        if (op->reply != NULL)
+          memcpy(op->reply, &reply[offset], op->reply_len);
+      }
+      if (op->cmd[5] == LIST_FILES && len >= 12)
+        op->list_left = ((unsigned char)reply[7] |
+                         (unsigned char)reply[8] << 8 |
+                         (unsigned char)reply[9] << 16 |
+                         (unsigned char)reply[10] << 24) -
+                        op->reply_len;
+    }
+
+    // Ask for the rest of a listing that did not fit in the reply, using the
+    // handle it came with. The operation stays in flight until the end.
+    if (op->cmd[5] == LIST_FILES && op->status == SUCCESS &&
+        op->list_left > 0 && op->reply != NULL) {
+      op->id = message_id_counter & 0xFFFF;
+      cont[0] = LX_byte1(7);  // length-2
+      cont[1] = LX_byte2(7);
+      cont[2] = LX_byte1(op->id);
+      cont[3] = LX_byte2(op->id);
+      cont[4] = SYSTEM_COMMAND_REPLY;
+      cont[5] = CONTINUE_LIST_FILES;
+      cont[6] = (unsigned char)reply[5] == CONTINUE_LIST_FILES ? reply[7]
+                                                              : reply[11];
+      cont[7] = LX_byte1(1012);  // max bytes to read
+      cont[8] = LX_byte2(1012);
+      message_id_counter++;
 #ifdef __BT_debug
-      fprintf(stderr, "BT_upload_file: Command failed\n");
+      fprintf(stderr, "BT_batch_run command string\n");
+      for (i = 0; i < 9; i++) {
+        fprintf(stderr, "%X, ", cont[i] & 0xff);
+      }
+      fprintf(stderr, "\n");
 #endif
-      return (reply[4]);
+      BT_write(cont, 9);
+      op->status = -1;
+      in_flight++;
+      continue;
     }
-    size -= n;
-    remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
+    if (op->status != SUCCESS && op->status != END_OF_FILE) failed++;
+    while (first < next && batch->ops[first].status != -1) first++;
   }
-  fclose(fp);
-  return (reply[6]);
+  return (failed);
+}
+
+void BT_batch_free(struct BT_batch *batch) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Free the operations of a batch and their replies.
+  //
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  for (int i = 0; i < batch->cnt; i++) {
+    free(batch->ops[i].cmd);
+    free(batch->ops[i].reply);
+  }
+  free(batch->ops);
+  BT_batch_init(batch);
+}
+
+int BT_delete_file(const char *path) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Delete the file or empty directory at path on the EV3.
+  //
+  // Returns: success code on successfull execution
+  //          error code on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_batch batch;
+  int status;
+
+  BT_batch_init(&batch);
+  if (BT_batch_delete_file(&batch, path) < 0) return (-1);
+  status = BT_batch_run(&batch, 1) < 0 ? -1 : batch.ops[0].status;
+  BT_batch_free(&batch);
+  return (status);
+}
+
+int BT_create_dir(const char *path) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Create the directory at path on the EV3.
+  //
+  // Returns: success code on successfull execution
+  //          error code on error (FILE_EXITS if it is already there)
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_batch batch;
+  int status;
+
+  BT_batch_init(&batch);
+  if (BT_batch_create_dir(&batch, path) < 0) return (-1);
+  status = BT_batch_run(&batch, 1) < 0 ? -1 : batch.ops[0].status;
+  BT_batch_free(&batch);
+  return (status);
+}
+
+void BT_frame_init(struct BT_frame *frame) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Start an empty frame of direct commands.
+  //
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  memset(frame->cmd, 0, sizeof(frame->cmd));
+  frame->len = 7;  // length, counter, type and memory header come first
+  frame->reads = 0;
+}
+
+static int BT_frame_room(struct BT_frame *frame, char layer, int len,
+                         const char *caller) {
+  // Check the layer, and that len more bytes fit in the frame
+  if (layer < LAYER_1 || layer > LAYER_4) {
+    fprintf(stderr, "%s: Invalid layer\n", caller);
+    return (0);
+  }
+  if (frame->len + len > (int)sizeof(frame->cmd)) {
+    fprintf(stderr, "%s: Frame is full\n", caller);
+    return (0);
+  }
+  return (1);
+}
+
+int BT_frame_motor_power(struct BT_frame *frame, char layer, char port_ids,
+                         char power) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Add setting and starting motors to a frame, as BT_motor_port_start_layer()
+  // does.
+  //
+  // Inputs: layer - LAYER_1 to LAYER_4
+  //         port ids of the motors, ORed together
+  //         power in [-100, 100]
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char *cmd = &frame->cmd[frame->len];
+
+  if (!BT_frame_room(frame, layer, 8, "BT_frame_motor_power")) return (-1);
+  if (power > 100 || power < -100 || port_ids > 15) {
+    fprintf(stderr, "BT_frame_motor_power: Invalid port id or power value\n");
+    return (-1);
+  }
+  cmd[0] = opOUTPUT_POWER;
+  cmd[1] = layer;
+  cmd[2] = port_ids;
+  cmd[3] = LC1_byte0();
+  cmd[4] = power;
+  cmd[5] = opOUTPUT_START;
+  cmd[6] = layer;
+  cmd[7] = port_ids;
+  frame->len += 8;
+  return (0);
+}
+
+int BT_frame_motor_stop(struct BT_frame *frame, char layer, char port_ids,
+                        int brake_mode) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Add stopping motors to a frame, as BT_motor_port_stop_layer() does.
+  //
+  // Inputs: layer - LAYER_1 to LAYER_4
+  //         port ids of the motors, ORed together
+  //         brake_mode: 0 -> roll to stop, 1 -> active brake
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char *cmd = &frame->cmd[frame->len];
+
+  if (!BT_frame_room(frame, layer, 4, "BT_frame_motor_stop")) return (-1);
+  if (port_ids > 15 || (brake_mode != 0 && brake_mode != 1)) {
+    fprintf(stderr, "BT_frame_motor_stop: Invalid port id or brake mode\n");
+    return (-1);
+  }
+  cmd[0] = opOUTPUT_STOP;
+  cmd[1] = layer;
+  cmd[2] = port_ids;
+  cmd[3] = brake_mode;
+  frame->len += 4;
+  return (0);
+}
+
+int BT_frame_read_sensor(struct BT_frame *frame, char layer, char sensor_port,
+                         char type, char mode, char ready) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Add a sensor read to a frame. The value is returned by BT_frame_send().
+  //
+  // Inputs: layer - LAYER_1 to LAYER_4
+  //         port identifier, PORT_1 to PORT_4
+  //         type and mode of the sensor, as in BT_sensor_set_type_mode()
+  //         ready - READY_PCT for a percentage (the touch sensor reads 0 or
+  //         100), READY_RAW for the raw value the other BT_read_*
+  //         functions return
+  //
+  // Returns: the index of the value in the array filled by BT_frame_send()
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char *cmd = &frame->cmd[frame->len];
+  int addr = 4 * frame->reads;
+
+  if (!BT_frame_room(frame, layer, 11, "BT_frame_read_sensor")) return (-1);
+  if (sensor_port > 3 || (ready != READY_PCT && ready != READY_RAW) ||
+      frame->reads == BT_FRAME_MAX_READS) {
+    fprintf(stderr, "BT_frame_read_sensor: Invalid read\n");
+    return (-1);
+  }
+  cmd[0] = opINPUT_DEVICE;
+  cmd[1] = LC0(ready);
+  cmd[2] = layer;
+  cmd[3] = sensor_port;
+  cmd[4] = LC1_byte0();  // type, which can be over 31
+  cmd[5] = type;
+  cmd[6] = LC0(mode);
+  cmd[7] = LC0(0x01);  // data set
+  if (addr <= PRIMPAR_INDEX) {
+    cmd[8] = GV0(addr);
+    frame->len += 9;
+  } else {
+    cmd[8] = GV1_byte0();
+    cmd[9] = addr;
+    frame->len += 10;
+  }
+  frame->ready[frame->reads] = ready;
+  return (frame->reads++);
+}
+
+int BT_frame_play_sound_file(struct BT_frame *frame, const char *path,
+                             int volume) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Add playing a sound file to a frame, as BT_play_sound_file() does. Sound
+  // commands have no layer, so the sound plays on LAYER_1.
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char *cmd = &frame->cmd[frame->len];
+  int path_len = strnlen(path, 1011);
+
+  if (!BT_frame_room(frame, LAYER_1, 6 + path_len, "BT_frame_play_sound_file"))
+    return (-1);
+  cmd[0] = opSOUND;
+  cmd[1] = PLAY;
+  cmd[2] = LC1_byte0();
+  cmd[3] = LX_byte1(volume);
+  cmd[4] = LCS;
+  memcpy(&cmd[5], path, path_len);
+  cmd[5 + path_len] = '\0';
+  frame->len += 6 + path_len;
+  return (0);
+}
+
+int BT_frame_send(struct BT_frame *frame, int values[]) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Send all the commands of a frame as one direct command, and wait for its
+  // reply. The EV3 runs them in the order they were added. The frame is kept,
+  // so the same commands can be sent again.
+  //
+  // Inputs: values - receives one value per BT_frame_read_sensor() call, may
+  //         be NULL if there are none
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  void *p;
+  unsigned char *cp;
+  unsigned char *cmd_string = frame->cmd;
+  char reply[1024];
+  int global_size = 4 * frame->reads, len, i;
+
+  cmd_string[0] = LX_byte1(frame->len - 2);  // length-2
+  cmd_string[1] = LX_byte2(frame->len - 2);
+  // Set message count id
+  p = (void *)&message_id_counter;
+  cp = (unsigned char *)p;
+  cmd_string[2] = *cp;
+  cmd_string[3] = *(cp + 1);
+  cmd_string[4] = DIRECT_COMMAND_REPLY;
+  cmd_string[5] = LX_byte1(global_size);
+  cmd_string[6] = LX_byte2(global_size);  // no local memory
+
+#ifdef __BT_debug
+  fprintf(stderr, "BT_frame_send command string\n");
+  for (i = 0; i < frame->len; i++) {
+    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  }
+  fprintf(stderr, "\n");
+#endif
+
+  BT_write(&cmd_string[0], frame->len);
+  len = BT_read_reply(&reply[0], sizeof(reply));
+  message_id_counter++;
+
+  if (len < 5 + global_size || reply[4] != DIRECT_REPLY) {
+    fprintf(stderr, "BT_frame_send: Command failed\n");
+    return (-1);
+  }
+  for (i = 0; i < frame->reads && values != NULL; i++) {
+    cp = (unsigned char *)&reply[5 + 4 * i];
+    if (frame->ready[i] == READY_PCT)
+      values[i] = (signed char)cp[0];
+    else
+      values[i] = cp[0] | cp[1] << 8 | cp[2] << 16 | (unsigned)cp[3] << 24;
+  }
+  return (0);
 }
 
 int BT_set_LED_colour(int colour) {
@@ -1738,8 +2489,8 @@ int BT_set_LED_colour(int colour) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 10);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 10);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1838,8 +2589,8 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0,
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 20 + path_len + 1);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 20 + path_len + 1);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1901,8 +2652,8 @@ int BT_store_current_display(int no) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 10);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 10);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -1968,8 +2719,8 @@ int BT_restore_previous_display(int no) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 12);
-  read(*socket_id, &reply[0], 1023);
+  BT_write(&cmd_string[0], 12);
+  BT_read(&reply[0], 1023);
 
   message_id_counter++;
 
@@ -48,16 +48,19 @@
 #define __btcomm_header
 
 // Standard UNIX libraries, should already be in your Linux box
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include "stdio.h"
 
@@ -73,6 +76,12 @@
 
 extern int message_id_counter;  // <-- Global message id counter
 
+// Transport hooks. When set, command strings are passed to BT_write_hook
+// instead of being written to the socket, and replies are taken from
+// BT_read_hook. Used by the EV3 simulator (see ev3sim.h).
+extern int (*BT_write_hook)(const void *buf, int len);
+extern int (*BT_read_hook)(void *buf, int len);
+
 // Hex identifiers for the 4 motor ports (defined by Lego)
 #define MOTOR_A 0x01
 #define MOTOR_B 0x02
@@ -143,6 +152,11 @@ extern int message_id_counter;  // <-- Global message id counter
 // Set up a socket to communicate with your Lego EV3 kit
 int BT_open(const char *device_id);
 
+// Same over WiFi, for a brick with a WiFi dongle on the PC's network. The
+// brick is found by its hex ID, so it can be reached both ways at once from
+// separate processes.
+int BT_open_wifi(const char *device_id);
+
 // Close open socket to your EV3 ending the communication with the bot
 int BT_close();
 
@@ -173,6 +187,59 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
                               int run_time, int ramp_down_time);
 int BT_timed_motor_port_start_v2(char port_id, char power, int time);
 
+// Daisy chain section
+// Up to four bricks chained over USB are all reached through the one the PC
+// is connected to. LAYER_1 is that brick and LAYER_2 to LAYER_4 are the ones
+// chained below it. The *_layer functions are the same as the functions
+// without the suffix, which address LAYER_1. Sounds have no layer in the EV3
+// bytecode and always play on LAYER_1.
+#define LAYER_1 0x00
+#define LAYER_2 0x01
+#define LAYER_3 0x02
+#define LAYER_4 0x03
+int BT_motor_port_start_layer(char layer, char port_ids, char power);
+int BT_motor_port_stop_layer(char layer, char port_ids, int brake_mode);
+int BT_all_stop_layer(char layer, int brake_mode);
+int BT_drive_layer(char layer, char lport, char rport, char power);
+int BT_turn_layer(char layer, char lport, char lpower, char rport,
+                  char rpower);
+int BT_timed_motor_port_start_layer(char layer, char port_id, char power,
+                                    int ramp_up_time, int run_time,
+                                    int ramp_down_time);
+int BT_read_touch_sensor_layer(char layer, char sensor_port);
+int BT_read_colour_sensor_layer(char layer, char sensor_port);
+int BT_read_colour_sensor_RGB_layer(char layer, char sensor_port, int RGB[3]);
+int BT_read_ultrasonic_sensor_layer(char layer, char sensor_port);
+int BT_read_gyro_sensor_layer(char layer, char sensor_port);
+
+// Each call above costs a round trip. A BT_frame instead collects motor,
+// sensor and sound commands for any layers and BT_frame_send() sends them as
+// a single direct command, so one step of a control loop over the whole
+// chain costs one round trip. For example:
+//
+//   BT_frame_init(&frame);
+//   BT_frame_motor_power(&frame, LAYER_1, MOTOR_A | MOTOR_B, 50);
+//   BT_frame_motor_power(&frame, LAYER_2, MOTOR_A, -30);
+//   i = BT_frame_read_sensor(&frame, LAYER_2, PORT_4, 30, 0, READY_RAW);
+//   BT_frame_send(&frame, values);    <-- values[i] is the distance in mm
+#define BT_FRAME_MAX_READS 16
+struct BT_frame {
+  unsigned char cmd[1024];  // Command string
+  int len;
+  int reads;                       // Number of sensor reads
+  char ready[BT_FRAME_MAX_READS];  // READY_PCT or READY_RAW for each read
+};
+void BT_frame_init(struct BT_frame *frame);
+int BT_frame_motor_power(struct BT_frame *frame, char layer, char port_ids,
+                         char power);
+int BT_frame_motor_stop(struct BT_frame *frame, char layer, char port_ids,
+                        int brake_mode);
+int BT_frame_read_sensor(struct BT_frame *frame, char layer, char sensor_port,
+                         char type, char mode, char ready);
+int BT_frame_play_sound_file(struct BT_frame *frame, const char *path,
+                             int volume);
+int BT_frame_send(struct BT_frame *frame, int values[]);
+
 // Sensor operation section
 // If no sensor is plugged into the sensor_port the readings will be 0 for that
 // sensor. If the wrong sensor is plugged into the port then there will be
@@ -193,12 +260,57 @@ void BT_get_type_mode(char sensor_port);
 void BT_sensor_set_mode(char sensor_port, char mode);
 int BT_check_if_busy(char sensor_port);
 int BT_play_sound_file(const char *path, int volume);
+int BT_sound_break(void);  // Stop the sound currently playing
 
 // System command section
 // Used for uploading files to the EV3 such as image and sound files in proper
 // format. EV3 accepts .rgf image files and .rsf sound files.
 int BT_list_files(char *path, char **contents);
 int BT_upload_file(const char *path_dest, const char *path_src);
+int BT_delete_file(const char *path);
+int BT_create_dir(const char *path);
+
+// The same upload a chunk at a time: BT_upload_begin() opens the file on
+// both ends, each BT_upload_next() sends the next PARTITION_SIZE bytes until
+// left is 0, and BT_upload_end() closes the local file.
+struct BT_upload {
+  FILE *fp;    // Local file
+  int handle;  // EV3 file handle
+  int left;    // Bytes still to send
+};
+int BT_upload_begin(struct BT_upload *upload, const char *path_dest,
+                    const char *path_src);
+int BT_upload_next(struct BT_upload *upload);
+void BT_upload_end(struct BT_upload *upload);
+
+// Batched system commands. Each BT_batch_* call above BT_batch_run() queues
+// one operation and returns its index in batch.ops. BT_batch_run() then
+// sends them with up to window operations in flight and matches the replies
+// by message counter, so many operations cost a few round trips instead of
+// one each. Listings longer than one reply are read to the end with
+// CONTINUE_LIST_FILES.
+#define BT_BATCH_WINDOW 8
+struct BT_batch_op {
+  unsigned char *cmd;  // Command string
+  int len;
+  int id;         // Message counter it was sent with, -1 until sent
+  int status;     // Reply status, -1 until answered
+  char *reply;    // LIST_FILES listing or LIST_OPEN_HANDLES bit field,
+  int reply_len;  // null-terminated
+  int list_left;  // Bytes of a LIST_FILES listing still to come
+};
+struct BT_batch {
+  struct BT_batch_op *ops;
+  int cnt, max;
+};
+void BT_batch_init(struct BT_batch *batch);
+int BT_batch_list_files(struct BT_batch *batch, const char *path);
+int BT_batch_delete_file(struct BT_batch *batch, const char *path);
+int BT_batch_create_dir(struct BT_batch *batch, const char *path);
+int BT_batch_close_handle(struct BT_batch *batch, int handle);
+int BT_batch_list_handles(struct BT_batch *batch);
+int BT_batch_run(struct BT_batch *batch, int window);
+void BT_batch_free(struct BT_batch *batch);
 
 // UI commands section
 // Used to interact with the display and LED lights around the buttons.
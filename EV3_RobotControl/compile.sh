@@ -1 +1,3 @@
 g++ btcomm_test.c btcomm.c -lbluetooth
+gcc -o ev3sim_test ev3sim_test.c ev3sim.c btcomm.c -lbluetooth -lm
+gcc -o ev3poll_test ev3poll_test.c ev3poll.c ev3sim.c btcomm.c -lbluetooth -lm
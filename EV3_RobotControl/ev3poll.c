@@ -0,0 +1,237 @@
+/***********************************************************************************************************************
+ *
+ * 	Adaptive sensor polling - see ev3poll.h for an overview.
+ *
+ * 	The activity of a port is its change per second divided by the port's
+ * fast value, capped at 1. A new read raises it at once, and lowers it by a
+ * quarter of the difference, so a single stable reading does not drop the
+ * rate straight to the minimum. The wanted rate is min_rate plus activity
+ * times the range up to max_rate.
+ *
+ * ********************************************************************************************************************/
+#include "ev3poll.h"
+#include <math.h>
+
+#define POLL_DECAY 0.25
+
+static struct POLL_port ports[POLL_MAX_PORTS];
+static int port_cnt;
+static double budget;
+
+// Upload fed with the spare budget: credit grows by POLL_spare() per second
+// and each chunk spends 1
+static struct BT_upload upload;
+static int upload_status = END_OF_FILE;
+static double credit, credit_time;
+
+static void POLL_allocate(double now) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Set the rate of every port from its activity, within the budget, and
+  // move the next read of ports that were not read now to match
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  double wanted[POLL_MAX_PORTS], minimum = 0, extra = 0, scale = 1;
+  int i;
+
+  for (i = 0; i < port_cnt; i++) {
+    wanted[i] = ports[i].min_rate +
+                ports[i].activity * (ports[i].max_rate - ports[i].min_rate);
+    minimum += ports[i].min_rate;
+    extra += wanted[i] - ports[i].min_rate;
+  }
+  // Minimum rates are always kept, the rest is shared out in proportion
+  if (minimum + extra > budget && extra > 0)
+    scale = fmax(0, budget - minimum) / extra;
+
+  for (i = 0; i < port_cnt; i++) {
+    ports[i].rate =
+        ports[i].min_rate + scale * (wanted[i] - ports[i].min_rate);
+    if (ports[i].last != now && ports[i].reads > 0)
+      ports[i].next = ports[i].last + 1 / ports[i].rate;
+  }
+}
+
+void POLL_open(double link_budget) {
+  budget = link_budget;
+  port_cnt = 0;
+  upload_status = END_OF_FILE;
+}
+
+int POLL_add(char layer, char sensor_port, char type, char mode, char ready,
+             double min_rate, double max_rate, double fast) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Add a port to poll
+  //
+  // Inputs: layer, port, type, mode and ready as in BT_frame_read_sensor()
+  //         min_rate and max_rate in reads per second
+  //         fast - change per second of the readings at which the port is
+  //         read at max_rate, in the units of the readings
+  //
+  // Returns: the index of the port
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct POLL_port *p = &ports[port_cnt];
+
+  if (port_cnt == POLL_MAX_PORTS || min_rate <= 0 || max_rate < min_rate ||
+      fast <= 0) {
+    fprintf(stderr, "POLL_add: Invalid port\n");
+    return (-1);
+  }
+  memset(p, 0, sizeof(*p));
+  p->layer = layer;
+  p->port = sensor_port;
+  p->type = type;
+  p->mode = mode;
+  p->ready = ready;
+  p->min_rate = min_rate;
+  p->max_rate = max_rate;
+  p->fast = fast;
+  p->activity = 1;
+  p->rate = max_rate;
+  return (port_cnt++);
+}
+
+int POLL_add_band(int index, int threshold) {
+  if (index < 0 || index >= port_cnt ||
+      ports[index].band_cnt == POLL_MAX_BANDS) {
+    fprintf(stderr, "POLL_add_band: Invalid band\n");
+    return (-1);
+  }
+  ports[index].bands[ports[index].band_cnt++] = threshold;
+  return (0);
+}
+
+int POLL_wake(int index) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Read the port at the next update and raise it to max_rate, for when the
+  // program knows its readings are about to change (e.g. it has just started
+  // a turn) and should not wait for the next read at the current rate
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (index < 0 || index >= port_cnt) {
+    fprintf(stderr, "POLL_wake: Invalid port\n");
+    return (-1);
+  }
+  ports[index].activity = 1;
+  ports[index].next = ports[index].last;
+  return (0);
+}
+
+static void POLL_send_chunks(double now) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send the next chunk of the upload once the spare budget has paid for it.
+  // Credit is not saved up beyond one chunk, so an update never sends a
+  // burst of them and holds up the next sensor reads.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (upload_status != SUCCESS) return;
+  credit = fmin(credit + POLL_spare() * (now - credit_time), 1);
+  credit_time = now;
+  if (credit < 1) return;
+  credit = 0;
+  upload_status = BT_upload_next(&upload);
+  if (upload_status == SUCCESS && upload.left == 0) upload_status = END_OF_FILE;
+  if (upload_status != SUCCESS) BT_upload_end(&upload);
+}
+
+int POLL_upload(const char *dest, const char *src, double now) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Start uploading src to dest on the EV3 in the background
+  //
+  // Returns: 0 once the upload has started
+  //          -1 if another upload is running or the EV3 refused it
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (upload_status == SUCCESS) {
+    fprintf(stderr, "POLL_upload: An upload is already running\n");
+    return (-1);
+  }
+  upload_status = BT_upload_begin(&upload, dest, src);
+  if (upload_status != SUCCESS) return (-1);
+  if (upload.left == 0) {
+    upload_status = END_OF_FILE;
+    BT_upload_end(&upload);
+  }
+  credit = 0;
+  credit_time = now;
+  return (0);
+}
+
+int POLL_upload_left() {
+  if (upload_status == SUCCESS) return upload.left;
+  return upload_status == END_OF_FILE ? 0 : -1;
+}
+
+int POLL_update(double now) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Read the ports that are due. Ports due within half a period are read
+  // now as well, so that they share the frame instead of needing another
+  // round trip shortly after.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  struct BT_frame frame;
+  int read[POLL_MAX_PORTS], values[POLL_MAX_PORTS], cnt = 0, i, b;
+
+  BT_frame_init(&frame);
+  for (i = 0; i < port_cnt; i++) {
+    struct POLL_port *p = &ports[i];
+    if (p->reads > 0 && p->next > now + 0.5 / p->rate) continue;
+    if (BT_frame_read_sensor(&frame, p->layer, p->port, p->type, p->mode,
+                             p->ready) < 0)
+      return (-1);
+    read[cnt++] = i;
+  }
+  if (cnt == 0) {
+    POLL_send_chunks(now);
+    return (0);
+  }
+  if (BT_frame_send(&frame, values) != 0) return (-1);
+
+  for (i = 0; i < cnt; i++) {
+    struct POLL_port *p = &ports[read[i]];
+    double change = 1;
+    if (p->reads > 0) {
+      change = now > p->last ? abs(values[i] - p->value) / (now - p->last) /
+                                   p->fast
+                             : 0;
+      for (b = 0; b < p->band_cnt; b++)
+        if ((p->value < p->bands[b]) != (values[i] < p->bands[b])) change = 1;
+    }
+    change = fmin(change, 1);
+    if (change > p->activity)
+      p->activity = change;
+    else
+      p->activity += POLL_DECAY * (change - p->activity);
+    p->value = values[i];
+    p->last = now;
+    p->reads++;
+  }
+  POLL_allocate(now);
+  for (i = 0; i < cnt; i++)
+    ports[read[i]].next = now + 1 / ports[read[i]].rate;
+  POLL_send_chunks(now);
+  return (cnt);
+}
+
+int POLL_value(int index) { return ports[index].value; }
+
+double POLL_next() {
+  double next = INFINITY;
+  for (int i = 0; i < port_cnt; i++) next = fmin(next, ports[i].next);
+  return next;
+}
+
+double POLL_spare() {
+  double used = 0;
+  for (int i = 0; i < port_cnt; i++) used += ports[i].rate;
+  return fmax(0, budget - used);
+}
+
+void POLL_print_rates(FILE *out) {
+  double used = 0;
+
+  fprintf(out, "Layer Port   Rate (Hz)  Range (Hz)   Reads  Value\n");
+  for (int i = 0; i < port_cnt; i++) {
+    struct POLL_port *p = &ports[i];
+    fprintf(out, "%5d %4d %11.1f %5.1f-%-6.1f %7d %6d\n", p->layer + 1,
+            p->port + 1, p->rate, p->min_rate, p->max_rate, p->reads, p->value);
+    used += p->rate;
+  }
+  fprintf(out, "Total %.1f of %.1f reads/s, %.1f spare\n", used, budget,
+          fmax(0, budget - used));
+}
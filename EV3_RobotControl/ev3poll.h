@@ -0,0 +1,92 @@
+/***********************************************************************************************************************
+ *
+ * 	Adaptive sensor polling - Reads each sensor only as often as its
+ * readings call for, instead of every sensor on every pass of the control
+ * loop.
+ *
+ * 	Each port polled is given a minimum and maximum rate, and the change per
+ * second at which it should be read at its maximum rate. Its rate follows
+ * how fast its readings actually change: it rises at once when they change
+ * quickly or cross one of the port's bands (for example a distance at which
+ * the robot has to react), and falls back gradually while they are stable.
+ * When the ports together ask for more reads than the link budget allows,
+ * the rate above each port's minimum is scaled down to fit. The part of the
+ * budget the ports do not need goes to an upload started with POLL_upload(),
+ * one chunk per read left over, so a file can be sent while the robot runs
+ * without slowing its sensors down.
+ *
+ * 	All the reads that are due are sent as a single BT_frame, whatever
+ * layer they are on, so one POLL_update() costs one round trip, plus one for
+ * each upload chunk it sends.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __ev3poll_header
+#define __ev3poll_header
+
+#include "btcomm.h"
+
+#define POLL_MAX_PORTS BT_FRAME_MAX_READS
+#define POLL_MAX_BANDS 4
+
+struct POLL_port {
+  // What to read, as in BT_frame_read_sensor()
+  char layer, port, type, mode, ready;
+
+  // Rate bounds in reads per second, and the change per second of the
+  // readings at which max_rate is wanted
+  double min_rate, max_rate;
+  double fast;
+  int bands[POLL_MAX_BANDS];
+  int band_cnt;
+
+  // State
+  int value;        // Last reading
+  int reads;        // Number of reads so far
+  double rate;      // Current rate in reads per second
+  double activity;  // 0 when stable, 1 when the port needs max_rate
+  double last, next;  // Time of the last read and of the next one
+};
+
+// Start polling with a budget of so many sensor reads per second in total
+void POLL_open(double budget);
+
+// Poll a sensor, returning its index or -1 if there are too many ports.
+// Ports start at their maximum rate until their readings settle.
+int POLL_add(char layer, char sensor_port, char type, char mode, char ready,
+             double min_rate, double max_rate, double fast);
+
+// Read the port at max_rate when its readings cross threshold
+int POLL_add_band(int index, int threshold);
+
+// Read the port at the next POLL_update() and at max_rate until its
+// readings settle, when the program is about to make them change
+int POLL_wake(int index);
+
+// Read the ports that are due at time now (in seconds, from any clock that
+// the program uses consistently, e.g. SIM_time()), and update the rates.
+// Returns the number of ports read, or -1 if the EV3 did not answer.
+int POLL_update(double now);
+
+// Last reading of a port
+int POLL_value(int index);
+
+// Time at which the next port is due, to sleep until then
+double POLL_next();
+
+// Reads per second of the budget not used by the ports right now, which
+// POLL_update() spends on the upload if one is running
+double POLL_spare();
+
+// Upload src to dest on the EV3 in the background: POLL_update() then sends
+// its next chunk whenever the spare budget has paid for one, at most one per
+// update. Only one upload runs at a time. Returns 0 if it started, -1 if not.
+int POLL_upload(const char *dest, const char *src, double now);
+
+// Bytes of the upload still to send, 0 when it is done, -1 if it failed
+int POLL_upload_left();
+
+// Print the rate, number of reads and last reading of every port
+void POLL_print_rates(FILE *out);
+
+#endif
@@ -0,0 +1,64 @@
+// Adaptive polling on the EV3 simulator - the robot drives across the arena
+// and turns away whenever the ultrasonic sensor sees the wall within 300 mm.
+// The rates chosen for each sensor are printed every 10 s of virtual time
+// and at the end of every turn: the ultrasonic sensor is read fast while the
+// wall comes closer, and the gyro while the robot turns. The turns are
+// short, so the gyro is woken up when one starts rather than left to notice
+// it at its slowest rate. A file given after the minutes is uploaded to the
+// EV3 meanwhile, with the reads the sensors leave spare.
+
+#include "ev3poll.h"
+#include "ev3sim.h"
+
+int main(int argc, char *argv[]) {
+  int minutes = 2, turning = 0, report = 10;
+  int touch, gyro, distance;
+
+  if (argc > 1) minutes = atoi(argv[1]);
+
+  SIM_open(NULL);
+  POLL_open(40);
+  touch = POLL_add(LAYER_1, PORT_1, EV3_TOUCH, 0, READY_PCT, 1, 20, 50);
+  gyro = POLL_add(LAYER_1, PORT_2, EV3_GYRO, 0, READY_RAW, 1, 20, 90);
+  distance = POLL_add(LAYER_1, PORT_4, EV3_ULTRASONIC, 0, READY_RAW, 2, 30, 200);
+  POLL_add_band(touch, 50);
+  POLL_add_band(distance, 300);
+  POLL_add_band(distance, 600);
+
+  if (argc > 2 &&
+      POLL_upload("/home/root/lms2012/prjs/sound/upload.rsf", argv[2],
+                  SIM_time()) != 0)
+    fprintf(stderr, "Cannot upload %s\n", argv[2]);
+
+  BT_drive(MOTOR_B, MOTOR_A, 40);
+  while (SIM_time() < minutes * 60) {
+    if (POLL_next() > SIM_time())
+      SIM_sleep((int)((POLL_next() - SIM_time()) * 1000) + 1);
+    SIM_loop_mark();
+    if (POLL_update(SIM_time()) < 0) break;
+
+    if (!turning && (POLL_value(distance) < 300 || POLL_value(touch) > 0)) {
+      BT_turn(MOTOR_B, 30, MOTOR_A, -30);
+      POLL_wake(gyro);
+      turning = 1;
+    } else if (turning && POLL_value(distance) > 600) {
+      BT_drive(MOTOR_B, MOTOR_A, 40);
+      fprintf(stderr, "t = %.1f s, turned to heading %d\n", SIM_time(),
+              POLL_value(gyro));
+      POLL_print_rates(stderr);
+      turning = 0;
+    }
+    if (SIM_time() >= report) {
+      fprintf(stderr, "t = %.0f s, %s, heading %d\n", SIM_time(),
+              turning ? "turning" : "driving", POLL_value(gyro));
+      POLL_print_rates(stderr);
+      if (argc > 2) fprintf(stderr, "Upload: %d bytes left\n", POLL_upload_left());
+      report += 10;
+    }
+  }
+  BT_all_stop(1);
+
+  SIM_print_stats(stderr);
+  SIM_close();
+  return 0;
+}
@@ -0,0 +1,545 @@
+/***********************************************************************************************************************
+ *
+ * 	EV3 simulator - see ev3sim.h for an overview.
+ *
+ * 	Command strings are interpreted directly: the bytecode operands are
+ * decoded the way the brick does (see the PRIMPAR_* encoding in bytecodes.h),
+ * global variables are filled in and a reply is queued with the time it
+ * would arrive at the host. Only the opcodes and system commands used by
+ * btcomm.c are understood, anything else gets an error reply.
+ *
+ * ********************************************************************************************************************/
+#include "ev3sim.h"
+#include <math.h>
+#include <time.h>
+
+#define SIM_MAX_REPLIES 64  // Initial size of the reply queue
+#define SIM_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Kinds of bytecode operands
+#define ARG_CONST 0
+#define ARG_LOCAL 1
+#define ARG_GLOBAL 2
+#define ARG_STRING 3
+
+static struct SIM_config sim;
+
+static struct {
+  double x, y, heading;
+  double power[4];      // Power set for each motor port, in %
+  double speed[4];      // Actual speed of each motor, in % of full speed
+  int running[4];
+  int brake[4];
+  double stop_time[4];  // End of a timed motor command, or -1
+  double time;
+} plant;
+
+// Replies waiting to be read, a ring buffer that grows when a program sends
+// more commands ahead of their replies than it holds
+struct SIM_reply {
+  unsigned char data[1024];
+  int len;
+  double sent, arrival;
+};
+static struct SIM_reply *replies;
+static int reply_head, reply_cnt, reply_max;
+
+// Link and brick timing: the host clock only moves when a reply is read or
+// the program sleeps, each direction of the link is busy while a command
+// string is being transferred, and the brick runs one command at a time
+static double host_time, up_free, down_free, brick_free;
+static int download_left;
+
+static struct {
+  long commands, replies, bytes_up, bytes_down;
+  double latency_sum, latency_max;
+  long loops;
+  double loop_start, loop_sum, loop_max;
+  struct timespec wall_start;
+} stats;
+
+void SIM_default_config(struct SIM_config *config) {
+  config->latency = 0.015;
+  config->bandwidth = 60000;
+  config->brick_time = 0.001;
+  config->left_motor = MOTOR_B;
+  config->right_motor = MOTOR_A;
+  config->wheel_speed = 300;
+  config->wheel_base = 120;
+  config->motor_tau = 0.1;
+  config->sensor_offset = 50;
+  config->sensor[PORT_1] = EV3_TOUCH;
+  config->sensor[PORT_2] = EV3_GYRO;
+  config->sensor[PORT_3] = EV3_COLOUR;
+  config->sensor[PORT_4] = EV3_ULTRASONIC;
+  config->arena = 2000;
+  config->line_radius = 600;
+  config->line_width = 25;
+  config->x = 400;
+  config->y = 1000;
+  config->heading = 0;
+  config->dt = 0.001;
+}
+
+static int SIM_motor_index(int bit) {
+  // MOTOR_A ... MOTOR_D to 0 ... 3
+  for (int i = 0; i < 4; i++)
+    if (bit == 1 << i) return i;
+  return 0;
+}
+
+static void SIM_step(double t) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Advance the robot model to time t
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int l = SIM_motor_index(sim.left_motor);
+  int r = SIM_motor_index(sim.right_motor);
+
+  while (plant.time < t) {
+    double dt = t - plant.time < sim.dt ? t - plant.time : sim.dt;
+    for (int i = 0; i < 4; i++) {
+      if (plant.stop_time[i] >= 0 && plant.time >= plant.stop_time[i]) {
+        plant.running[i] = 0;
+        plant.stop_time[i] = -1;
+      }
+      double target = plant.running[i] ? plant.power[i] : 0;
+      double tau = plant.running[i] || !plant.brake[i] ? sim.motor_tau
+                                                        : sim.motor_tau / 5;
+      double k = dt / tau < 1 ? dt / tau : 1;
+      plant.speed[i] += (target - plant.speed[i]) * k;
+    }
+
+    double vl = plant.speed[l] / 100 * sim.wheel_speed;
+    double vr = plant.speed[r] / 100 * sim.wheel_speed;
+    double h = plant.heading * M_PI / 180;
+    plant.x += (vl + vr) / 2 * sin(h) * dt;
+    plant.y += (vl + vr) / 2 * cos(h) * dt;
+    plant.heading += (vl - vr) / sim.wheel_base * dt * 180 / M_PI;
+    plant.x = plant.x < 0 ? 0 : plant.x > sim.arena ? sim.arena : plant.x;
+    plant.y = plant.y < 0 ? 0 : plant.y > sim.arena ? sim.arena : plant.y;
+    plant.time += dt;
+  }
+}
+
+static double SIM_wall_distance() {
+  // Distance from the robot to the arena wall straight ahead, in mm
+  double h = plant.heading * M_PI / 180;
+  double dx = sin(h), dy = cos(h), d = 1e9;
+  if (dx > 1e-9) d = fmin(d, (sim.arena - plant.x) / dx);
+  if (dx < -1e-9) d = fmin(d, -plant.x / dx);
+  if (dy > 1e-9) d = fmin(d, (sim.arena - plant.y) / dy);
+  if (dy < -1e-9) d = fmin(d, -plant.y / dy);
+  return d;
+}
+
+static int SIM_sensor(int port, int mode, int index) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Reading of the sensor at the given port, in the units btcomm.c expects
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  double h = plant.heading * M_PI / 180;
+  double sx = plant.x + sim.sensor_offset * sin(h);
+  double sy = plant.y + sim.sensor_offset * cos(h);
+  double c = sim.arena / 2;
+  int on_line =
+      fabs(hypot(sx - c, sy - c) - sim.line_radius) < sim.line_width / 2;
+
+  if (port < 0 || port > 3) return 0;
+  switch (sim.sensor[port]) {
+    case EV3_TOUCH:
+      return SIM_wall_distance() < sim.sensor_offset ? 100 : 0;
+    case EV3_COLOUR:
+      if (mode == 4) return on_line ? 40 : 400 + 10 * index;  // RGB
+      return on_line ? 1 : 6;                                  // Black/White
+    case EV3_ULTRASONIC:
+      return (int)fmin(SIM_wall_distance(), 2550);
+    case EV3_GYRO:
+      return (int)lround(plant.heading);
+  }
+  return 0;
+}
+
+static int SIM_arg(const unsigned char **pc, int *kind, const char **str) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Decode one bytecode operand, returning its value (or variable address)
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char b = *(*pc)++;
+  int value = 0;
+
+  if ((b & PRIMPAR_LONG) == 0) {
+    if (b & PRIMPAR_VARIABEL) {
+      *kind = b & PRIMPAR_GLOBAL ? ARG_GLOBAL : ARG_LOCAL;
+      return b & PRIMPAR_INDEX;
+    }
+    *kind = ARG_CONST;
+    value = b & PRIMPAR_VALUE;
+    return value & PRIMPAR_CONST_SIGN ? value - 64 : value;
+  }
+  if ((b & PRIMPAR_BYTES) == PRIMPAR_STRING && !(b & PRIMPAR_VARIABEL)) {
+    *kind = ARG_STRING;
+    if (str != NULL) *str = (const char *)*pc;
+    while (*(*pc)++ != 0)
+      ;
+    return 0;
+  }
+  *kind = b & PRIMPAR_VARIABEL ? (b & PRIMPAR_GLOBAL ? ARG_GLOBAL : ARG_LOCAL)
+                               : ARG_CONST;
+  switch (b & PRIMPAR_BYTES) {
+    case PRIMPAR_1_BYTE:
+      value = (signed char)(*pc)[0];
+      *pc += 1;
+      break;
+    case PRIMPAR_2_BYTES:
+      value = (short)((*pc)[0] | (*pc)[1] << 8);
+      *pc += 2;
+      break;
+    case PRIMPAR_4_BYTES:
+      value = (int)((*pc)[0] | (*pc)[1] << 8 | (*pc)[2] << 16 |
+                    (unsigned)(*pc)[3] << 24);
+      *pc += 4;
+      break;
+  }
+  return value;
+}
+
+static int SIM_value(const unsigned char **pc) {
+  int kind;
+  return SIM_arg(pc, &kind, NULL);
+}
+
+static void SIM_store(unsigned char *global, int global_size,
+                      const unsigned char **pc, int value, int bytes) {
+  // Store value in the global variable named by the next operand
+  int kind, addr = SIM_arg(pc, &kind, NULL);
+  if (kind != ARG_GLOBAL) return;
+  for (int i = 0; i < bytes && addr + i < global_size; i++)
+    global[addr + i] = (value >> (8 * i)) & 0xFF;
+}
+
+static int SIM_direct(const unsigned char *pc, const unsigned char *end,
+                      unsigned char *global, int global_size, double *busy) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Run the bytecodes of a direct command. Time spent waiting on timers is
+  // added to busy. Returns 0 on success, -1 if an opcode is not supported.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  double start = plant.time;
+
+  while (pc < end) {
+    int op = *pc++;
+    int ports, power, port, mode, cnt, sub, kind;
+
+    switch (op) {
+      case opOUTPUT_POWER:
+        SIM_value(&pc);  // layer
+        ports = SIM_value(&pc);
+        power = SIM_value(&pc);
+        for (int i = 0; i < 4; i++)
+          if (ports & (1 << i)) plant.power[i] = power;
+        break;
+      case opOUTPUT_START:
+        SIM_value(&pc);
+        ports = SIM_value(&pc);
+        for (int i = 0; i < 4; i++)
+          if (ports & (1 << i)) {
+            plant.running[i] = 1;
+            plant.stop_time[i] = -1;
+          }
+        break;
+      case opOUTPUT_STOP:
+        SIM_value(&pc);
+        ports = SIM_value(&pc);
+        sub = SIM_value(&pc);  // brake
+        for (int i = 0; i < 4; i++)
+          if (ports & (1 << i)) {
+            plant.running[i] = 0;
+            plant.brake[i] = sub;
+          }
+        break;
+      case opOUTPUT_TIME_POWER: {
+        SIM_value(&pc);
+        ports = SIM_value(&pc);
+        power = SIM_value(&pc);
+        double t = SIM_value(&pc);
+        t += SIM_value(&pc);
+        t += SIM_value(&pc);
+        sub = SIM_value(&pc);
+        for (int i = 0; i < 4; i++)
+          if (ports & (1 << i)) {
+            plant.power[i] = power;
+            plant.running[i] = 1;
+            plant.brake[i] = sub;
+            plant.stop_time[i] = plant.time + t / 1000;
+          }
+        break;
+      }
+      case opINPUT_DEVICE:
+        sub = SIM_value(&pc);
+        SIM_value(&pc);  // layer
+        port = SIM_value(&pc);
+        if (sub == GET_TYPEMODE) {
+          SIM_store(global, global_size, &pc,
+                    port >= 0 && port < 4 && sim.sensor[port] ? sim.sensor[port]
+                                                              : 126, 1);
+          SIM_store(global, global_size, &pc, 0, 1);
+        } else if (sub == READY_RAW || sub == READY_PCT) {
+          SIM_value(&pc);  // type
+          mode = SIM_value(&pc);
+          cnt = SIM_value(&pc);
+          for (int i = 0; i < cnt; i++)
+            SIM_store(global, global_size, &pc, SIM_sensor(port, mode, i),
+                      sub == READY_RAW ? 4 : 1);
+        } else {
+          return (-1);
+        }
+        break;
+      case opINPUT_READEXT:
+        SIM_value(&pc);
+        port = SIM_value(&pc);
+        SIM_value(&pc);  // type
+        mode = SIM_value(&pc);
+        SIM_value(&pc);  // format
+        cnt = SIM_value(&pc);
+        for (int i = 0; i < cnt; i++)
+          SIM_store(global, global_size, &pc, SIM_sensor(port, mode, i), 4);
+        break;
+      case opSOUND:
+        sub = SIM_value(&pc);
+        if (sub == TONE) {
+          SIM_value(&pc);
+          SIM_value(&pc);
+          SIM_value(&pc);
+        } else if (sub == PLAY || sub == REPEAT) {
+          SIM_value(&pc);
+          SIM_arg(&pc, &kind, NULL);
+        } else if (sub != BREAK) {
+          return (-1);
+        }
+        break;
+      case opSOUND_READY:
+        break;
+      case opUI_WRITE:
+        sub = SIM_value(&pc);
+        if (sub != LED) return (-1);
+        SIM_value(&pc);
+        break;
+      case opUI_DRAW:
+        sub = SIM_value(&pc);
+        if (sub == BMPFILE) {
+          SIM_value(&pc);
+          SIM_value(&pc);
+          SIM_value(&pc);
+          SIM_arg(&pc, &kind, NULL);
+        } else if (sub == STORE || sub == RESTORE) {
+          SIM_value(&pc);
+        } else if (sub != UPDATE) {
+          return (-1);
+        }
+        break;
+      case opCOM_SET:
+        sub = SIM_value(&pc);
+        if (sub != SET_BRICKNAME) return (-1);
+        SIM_arg(&pc, &kind, NULL);
+        break;
+      case opTIMER_WAIT:
+        *busy += SIM_value(&pc) / 1000.0;
+        SIM_value(&pc);
+        break;
+      case opTIMER_READY:
+        // Later opcodes run once the timer has expired
+        SIM_value(&pc);
+        SIM_step(start + *busy);
+        break;
+      default:
+        return (-1);
+    }
+  }
+  return (0);
+}
+
+static int SIM_system(const unsigned char *cmd, int len, unsigned char *reply) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Answer a system command, returning the number of reply bytes after the
+  // status byte
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  reply[6] = SUCCESS;
+  switch (cmd[5]) {
+    case BEGIN_DOWNLOAD:
+      download_left = cmd[6] | cmd[7] << 8 | cmd[8] << 16 | cmd[9] << 24;
+      reply[7] = 0;  // handle
+      return 1;
+    case CONTINUE_DOWNLOAD:
+      download_left -= len - 7;
+      if (download_left <= 0) reply[6] = END_OF_FILE;
+      reply[7] = cmd[6];
+      return 1;
+    case LIST_FILES:
+      // An empty folder: list size and handle
+      reply[6] = END_OF_FILE;
+      memset(&reply[7], 0, 5);
+      return 5;
+    case LIST_OPEN_HANDLES:
+      // No handles open
+      memset(&reply[7], 0, 4);
+      return 4;
+  }
+  return 0;
+}
+
+static int SIM_write(const void *buf, int len) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Transport hook: run a command string and queue its reply
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  const unsigned char *cmd = (const unsigned char *)buf;
+  unsigned char reply[1024];
+  int reply_len = 0;
+  double busy = 0;
+
+  memset(reply, 0, sizeof(reply));
+  stats.commands++;
+  stats.bytes_up += len;
+
+  up_free = SIM_MAX(host_time, up_free) + len / sim.bandwidth;
+  double start = SIM_MAX(up_free + sim.latency, brick_free);
+  SIM_step(start);
+
+  if (len < 5) return len;
+  int type = cmd[4];
+  reply[2] = cmd[2];
+  reply[3] = cmd[3];
+  if (type == DIRECT_COMMAND_REPLY || type == DIRECT_COMMAND_NO_REPLY) {
+    int global_size = len > 6 ? (cmd[5] | (cmd[6] & 0x03) << 8) : 0;
+    int ok = SIM_direct(cmd + 7, cmd + len, &reply[5], global_size, &busy);
+    reply[4] = ok == 0 ? DIRECT_REPLY : DIRECT_REPLY_ERROR;
+    reply_len = 5 + global_size;
+  } else if (type == SYSTEM_COMMAND_REPLY || type == SYSTEM_COMMAND_NO_REPLY) {
+    reply[4] = SYSTEM_REPLY;
+    reply[5] = cmd[5];
+    reply_len = 7 + SIM_system(cmd, len, reply);
+  }
+  brick_free = start + sim.brick_time + busy;
+
+  if (type == DIRECT_COMMAND_NO_REPLY || type == SYSTEM_COMMAND_NO_REPLY ||
+      reply_len == 0)
+    return len;
+  if (reply_cnt == reply_max) {
+    int max = reply_max == 0 ? SIM_MAX_REPLIES : 2 * reply_max;
+    struct SIM_reply *grown =
+        (struct SIM_reply *)malloc(max * sizeof(struct SIM_reply));
+    if (grown == NULL) {
+      perror("SIM_write");
+      return (-1);
+    }
+    for (int i = 0; i < reply_cnt; i++)
+      grown[i] = replies[(reply_head + i) % reply_max];
+    free(replies);
+    replies = grown;
+    reply_head = 0;
+    reply_max = max;
+  }
+
+  reply[0] = (reply_len - 2) & 0xFF;
+  reply[1] = ((reply_len - 2) >> 8) & 0xFF;
+  down_free = SIM_MAX(brick_free, down_free) + reply_len / sim.bandwidth;
+
+  int slot = (reply_head + reply_cnt++) % reply_max;
+  memcpy(replies[slot].data, reply, reply_len);
+  replies[slot].len = reply_len;
+  replies[slot].sent = host_time;
+  replies[slot].arrival = down_free + sim.latency;
+  return len;
+}
+
+static int SIM_read(void *buf, int len) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Transport hook: deliver the oldest queued reply, moving the host clock to
+  // the time it arrives
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (reply_cnt == 0) return 0;
+
+  int n = replies[reply_head].len < len ? replies[reply_head].len : len;
+  double latency = replies[reply_head].arrival - replies[reply_head].sent;
+  memcpy(buf, replies[reply_head].data, n);
+  host_time = SIM_MAX(host_time, replies[reply_head].arrival);
+  reply_head = (reply_head + 1) % reply_max;
+  reply_cnt--;
+
+  stats.replies++;
+  stats.bytes_down += n;
+  stats.latency_sum += latency;
+  if (latency > stats.latency_max) stats.latency_max = latency;
+  return n;
+}
+
+int SIM_open(const struct SIM_config *config) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Start the simulator. All later BT_* calls are answered by it until
+  // SIM_close() is called.
+  //
+  // Inputs: The simulator configuration, or NULL for the defaults
+  // Returns: 0 on success
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (config != NULL)
+    sim = *config;
+  else
+    SIM_default_config(&sim);
+
+  memset(&plant, 0, sizeof(plant));
+  memset(&stats, 0, sizeof(stats));
+  plant.x = sim.x;
+  plant.y = sim.y;
+  plant.heading = sim.heading;
+  for (int i = 0; i < 4; i++) plant.stop_time[i] = -1;
+  host_time = up_free = down_free = brick_free = 0;
+  reply_head = reply_cnt = 0;
+  clock_gettime(CLOCK_MONOTONIC, &stats.wall_start);
+
+  BT_write_hook = SIM_write;
+  BT_read_hook = SIM_read;
+  fprintf(stderr, "EV3 simulator started\n");
+  return 0;
+}
+
+int SIM_close() {
+  BT_write_hook = NULL;
+  BT_read_hook = NULL;
+  free(replies);
+  replies = NULL;
+  reply_head = reply_cnt = reply_max = 0;
+  return 0;
+}
+
+void SIM_sleep(int ms) { host_time += ms / 1000.0; }
+
+double SIM_time() { return host_time; }
+
+void SIM_loop_mark() {
+  if (stats.loops > 0) {
+    double period = host_time - stats.loop_start;
+    stats.loop_sum += period;
+    if (period > stats.loop_max) stats.loop_max = period;
+  }
+  stats.loops++;
+  stats.loop_start = host_time;
+}
+
+void SIM_print_stats(FILE *out) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double wall = now.tv_sec - stats.wall_start.tv_sec +
+                (now.tv_nsec - stats.wall_start.tv_nsec) / 1e9;
+
+  fprintf(out, "Virtual time: %.3f s (%.3f s real, %.0fx)\n", host_time, wall,
+          wall > 0 ? host_time / wall : 0);
+  fprintf(out, "Commands: %ld (%.1f/s), %ld bytes sent, %ld bytes received\n",
+          stats.commands, host_time > 0 ? stats.commands / host_time : 0,
+          stats.bytes_up, stats.bytes_down);
+  if (stats.replies > 0)
+    fprintf(out, "Command latency: mean %.1f ms, max %.1f ms\n",
+            1000 * stats.latency_sum / stats.replies, 1000 * stats.latency_max);
+  if (stats.loops > 1)
+    fprintf(out, "Control loop: %ld iterations, mean %.1f ms (%.1f Hz), max "
+                 "%.1f ms\n",
+            stats.loops, 1000 * stats.loop_sum / (stats.loops - 1),
+            (stats.loops - 1) / stats.loop_sum, 1000 * stats.loop_max);
+  fprintf(out, "Robot at x=%.0f mm, y=%.0f mm, heading %.1f degrees\n",
+          plant.x, plant.y, plant.heading);
+}
@@ -0,0 +1,82 @@
+/***********************************************************************************************************************
+ *
+ * 	EV3 simulator - A stand-in for the EV3 brick that runs on virtual time,
+ * so control loops written against the BT_* API can be tested and tuned
+ * without hardware, much faster than real time and with identical results
+ * on every run.
+ *
+ * 	Call SIM_open() instead of BT_open(). From then on every BT_* call is
+ * answered by the simulator: motor commands drive a simple two-wheeled robot
+ * in a square arena with a circular line on the floor, and sensor reads are
+ * answered from its position. Sending a command and reading its reply each
+ * take the modelled link latency and transfer time, and time only advances
+ * as commands are exchanged or through SIM_sleep(). Several commands sent
+ * before their replies are read share the link, so batching and pipelining
+ * show up in the statistics.
+ *
+ * 	Use SIM_sleep() where the program would otherwise sleep, mark each
+ * iteration of the control loop with SIM_loop_mark(), and call
+ * SIM_print_stats() at the end to get loop latency and throughput figures.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __ev3sim_header
+#define __ev3sim_header
+
+#include "btcomm.h"
+
+// Sensor types that can be attached to the simulated input ports (EV3
+// device type numbers, as reported by BT_get_type_mode())
+#define EV3_NONE 0
+#define EV3_TOUCH 16
+#define EV3_ULTRASONIC 30
+
+struct SIM_config {
+  // Link model
+  double latency;    // One-way latency in seconds
+  double bandwidth;  // Bytes per second in each direction
+  double brick_time; // Time the brick takes to run one command, in seconds
+
+  // Robot model
+  char left_motor, right_motor;  // Motor ports driving the wheels
+  double wheel_speed;            // Wheel speed at 100% power, in mm/s
+  double wheel_base;             // Distance between the wheels, in mm
+  double motor_tau;              // Motor time constant, in seconds
+  double sensor_offset;  // Distance of the colour and touch sensors ahead of
+                         // the wheels, in mm
+  char sensor[4];        // Sensor type at PORT_1 ... PORT_4
+
+  // World model
+  double arena;        // Side of the square arena, in mm
+  double line_radius;  // Radius of the black line around the arena centre
+  double line_width;   // Width of the line, in mm
+  double x, y;         // Starting position, in mm
+  double heading;      // Starting heading, in degrees clockwise from +y
+  double dt;           // Integration step, in seconds
+};
+
+// Fill config with the defaults: a Bluetooth-like link (15 ms each way,
+// 60 KB/s), MOTOR_B on the left wheel and MOTOR_A on the right, a touch
+// sensor at PORT_1, gyro at PORT_2, colour sensor at PORT_3 and ultrasonic
+// sensor at PORT_4, starting on the line of a 2 m arena
+void SIM_default_config(struct SIM_config *config);
+
+// Start the simulator, or with config == NULL the defaults
+int SIM_open(const struct SIM_config *config);
+
+// Stop the simulator, after which BT_* calls go to the socket again
+int SIM_close();
+
+// Let virtual time pass, in place of sleep()/usleep() in the control program
+void SIM_sleep(int ms);
+
+// Current virtual time in seconds
+double SIM_time();
+
+// Mark the start of a control loop iteration, for the loop latency figures
+void SIM_loop_mark();
+
+// Print timing and throughput statistics, and the robot's final pose
+void SIM_print_stats(FILE *out);
+
+#endif
@@ -0,0 +1,28 @@
+// Line following on the EV3 simulator - runs 10 minutes of virtual time
+// and reports how fast the control loop ran. The robot follows the left
+// edge of the circular line, so it goes round clockwise.
+
+#include "ev3sim.h"
+
+int main(int argc, char *argv[]) {
+  int minutes = 10;
+  int laps_angle;
+
+  if (argc > 1) minutes = atoi(argv[1]);
+
+  SIM_open(NULL);
+  while (SIM_time() < minutes * 60) {
+    SIM_loop_mark();
+    if (BT_read_colour_sensor(PORT_3) == 1)
+      BT_turn(MOTOR_B, 20, MOTOR_A, 50);  // On the line, steer left
+    else
+      BT_turn(MOTOR_B, 50, MOTOR_A, 20);  // Off the line, steer right
+  }
+  laps_angle = BT_read_gyro_sensor(PORT_2);
+  BT_all_stop(1);
+
+  SIM_print_stats(stderr);
+  fprintf(stderr, "Laps: %.1f\n", laps_angle / 360.0);
+  SIM_close();
+  return 0;
+}
@@ -1,2 +1,5 @@
-gcc -o rsfConverter rsfConverter.c EV3_RobotControl/btcomm.c -lbluetooth
-gcc -o rsfPlayer rsfPlayer.c EV3_RobotControl/btcomm.c -lbluetooth
+gcc -O2 -ftree-vectorize -o rsfConverter rsfConverter.c rsf.c EV3_RobotControl/btcomm.c -lbluetooth -lpthread
+gcc -o rsfPlayer rsfPlayer.c rsf.c EV3_RobotControl/btcomm.c -lbluetooth -lpthread
+gcc -O2 -o rsfWatch rsfWatch.c rsf.c EV3_RobotControl/btcomm.c -lbluetooth -lpthread
+gcc -O2 -o rsfPlan rsfPlan.c rsf.c EV3_RobotControl/btcomm.c -lbluetooth -lpthread
+gcc -O2 -o rsfCheck rsfCheck.c rsf.c EV3_RobotControl/btcomm.c -lbluetooth -lpthread
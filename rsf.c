@@ -0,0 +1,1222 @@
+#include "rsf.h"
+#include "EV3_RobotControl/btcomm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+// IMA ADPCM tables, as used by the EV3 firmware to play RSF_FORMAT_ADPCM files
+static const short adpcm_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767};
+static const signed char adpcm_index[16] = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                            -1, -1, -1, -1, 2, 4, 6, 8};
+
+void rsf_base_name(char *name, const char *path)
+{
+    strcpy(name, path);
+    int name_len = strlen(name);
+    int dot = name_len - 1;
+    while (dot >= 0 && name[dot] != '.' && name[dot] != '/')
+        dot -= 1;
+    if (dot < 0 || name[dot] == '/')
+        dot = name_len;
+    name[dot] = 0;
+}
+
+// Append path to cmd as a single-quoted shell word
+static void quote_path(char *cmd, const char *path)
+{
+    cmd += strlen(cmd);
+    *cmd++ = '\'';
+    for (; *path; path += 1)
+    {
+        if (*path == '\'')
+        {
+            strcpy(cmd, "'\\''");
+            cmd += 4;
+        }
+        else
+            *cmd++ = *path;
+    }
+    *cmd++ = '\'';
+    *cmd = 0;
+}
+
+int rsf_write_segment(const char *path, const unsigned char *data, int size, int rate, int format)
+{
+    unsigned char header[RSF_HEADER_SIZE];
+    // The header has 16 bits for the size
+    if (size < 0 || size > RSF_MAX_PAYLOAD)
+    {
+        debug("Error: %d bytes do not fit in segment %s.\n", size, path);
+        return -1;
+    }
+    header[0] = format >> 8;
+    header[1] = format & ((1 << 8) - 1);
+    header[2] = size >> 8;
+    header[3] = size & ((1 << 8) - 1);
+    header[4] = rate >> 8;
+    header[5] = rate & ((1 << 8) - 1);
+    header[6] = 0x00;
+    header[7] = 0x00;
+
+    // Leave identical segments alone so they do not need to be uploaded again
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat st;
+        int same = 0;
+        if (fstat(fd, &st) == 0 && st.st_size == RSF_HEADER_SIZE + size)
+        {
+            unsigned char *old = malloc(RSF_HEADER_SIZE + size);
+            if (old != NULL && read(fd, old, RSF_HEADER_SIZE + size) == RSF_HEADER_SIZE + size)
+                same = memcmp(old, header, RSF_HEADER_SIZE) == 0 && memcmp(old + RSF_HEADER_SIZE, data, size) == 0;
+            free(old);
+        }
+        close(fd);
+        if (same)
+            return 0;
+    }
+
+    // Replace rather than overwrite the file, it may be hard linked to a
+    // shared segment (see rsf_share_segments())
+    unlink(path);
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        debug("Error: Cannot open output file %s.\n", path);
+        return -1;
+    }
+    write(fd, header, RSF_HEADER_SIZE);
+    write(fd, data, size);
+    close(fd);
+    return 1;
+}
+
+int rsf_decode(const char *src, int rate, short **samples)
+{
+    char cmd[4096] = "ffmpeg -nostdin -loglevel error -i ";
+    int n = 0, cap = 1 << 16, size;
+
+    // Quoting makes the path at most four times longer
+    if (strlen(cmd) + 4 * strlen(src) + 64 > sizeof(cmd))
+    {
+        debug("Error: Path too long for %s.\n", src);
+        return -1;
+    }
+    quote_path(cmd, src);
+    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " -acodec pcm_s16le -f s16le -ac 1 -ar %d -", rate);
+    FILE *in = popen(cmd, "r");
+    if (in == NULL)
+    {
+        debug("Error: Cannot run ffmpeg.\n");
+        return -1;
+    }
+    short *buffer = malloc(cap * sizeof(short));
+    while (buffer != NULL && (size = fread(buffer + n, sizeof(short), cap - n, in)) > 0)
+    {
+        n += size;
+        if (n == cap)
+        {
+            short *grown = realloc(buffer, 2 * cap * sizeof(short));
+            if (grown == NULL)
+            {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            cap *= 2;
+        }
+    }
+    if (pclose(in) != 0 || buffer == NULL || n == 0)
+    {
+        debug("Error: Cannot convert %s to .rsf files.\n", src);
+        debug("Please check the file name, and whether ffmpeg is correctly installed.\n");
+        free(buffer);
+        return -1;
+    }
+    *samples = buffer;
+    return n;
+}
+
+// The peak and gain loops are kept simple enough for GCC to vectorize, which
+// at -O2 takes -ftree-vectorize (see compile.sh)
+void rsf_normalize(short *samples, int n, int rate, double peak)
+{
+    const int lookahead = 5;      // blocks, 50 ms
+    const double release = 0.05;  // fraction of the gap closed per block
+    int block = rate / 100 > 0 ? rate / 100 : 1;
+    int block_cnt = (n + block - 1) / block;
+    int *peaks = malloc((block_cnt + lookahead) * sizeof(int));
+    float target = peak * 32767;
+    float gain = 0;
+
+    if (peaks == NULL)
+        return;
+    for (int b = 0; b < block_cnt + lookahead; b += 1)
+    {
+        int max = 0;
+        for (int i = b * block; i < (b + 1) * block && i < n; i += 1)
+            max = abs(samples[i]) > max ? abs(samples[i]) : max;
+        peaks[b] = max;
+    }
+    for (int b = 0; b < block_cnt; b += 1)
+    {
+        int max = 0;
+        for (int k = b; k <= b + lookahead; k += 1)
+            max = peaks[k] > max ? peaks[k] : max;
+        float want = max > 0 && target / max < RSF_MAX_GAIN ? target / max : RSF_MAX_GAIN;
+
+        // Nothing came before the first block to look ahead at it, so start
+        // at the gain it wants rather than ramping down to it
+        if (b == 0)
+            gain = want;
+        float next = want < gain ? want : gain + (want - gain) * release;
+
+        // Both ends of the ramp are below target / peaks[b], as the previous
+        // block looked ahead far enough to see this one, so nothing clips
+        int len = b == block_cnt - 1 ? n - b * block : block;
+        short *x = samples + b * block;
+        float step = (next - gain) / block;
+        for (int i = 0; i < len; i += 1)
+        {
+            float y = x[i] * (gain + step * i);
+            x[i] = y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+        }
+        gain = next;
+    }
+    free(peaks);
+}
+
+// Convert n samples at rate_in to unsigned 8-bit samples at rate_out. When
+// downsampling every output sample is the mean of the input samples it covers,
+// which doubles as a cheap anti-aliasing filter.
+static int resample_u8(const short *in, int n, int rate_in, unsigned char *out, int rate_out)
+{
+    int m = (long long)n * rate_out / rate_in;
+    if (rate_in == rate_out)
+    {
+        for (int i = 0; i < n; i += 1)
+            out[i] = (in[i] >> 8) + 0x80;
+        return n;
+    }
+    for (int i = 0; i < m; i += 1)
+    {
+        long long lo = (long long)i * rate_in / rate_out;
+        long long hi = (long long)(i + 1) * rate_in / rate_out;
+        int sum = 0;
+        if (hi <= lo)
+            hi = lo + 1;
+        if (hi > n)
+            hi = n;
+        for (long long k = lo; k < hi; k += 1)
+            sum += in[k];
+        out[i] = ((sum / (int)(hi - lo)) >> 8) + 0x80;
+    }
+    return m;
+}
+
+// Encode n unsigned 8-bit samples as ADPCM, tracking the decoder state the
+// firmware will have so the quantization error does not accumulate.
+// Returns the number of bytes written to out.
+static int adpcm_encode(const unsigned char *in, int n, unsigned char *out)
+{
+    int prev = 0x7F, index = 20;
+    for (int i = 0; i < n; i += 1)
+    {
+        int step = adpcm_steps[index];
+        int diff = in[i] - prev;
+        int delta = step >> 3;
+        int code = 0;
+        if (diff < 0)
+        {
+            code = 8;
+            diff = -diff;
+        }
+        if (diff >= step)
+        {
+            code |= 4;
+            diff -= step;
+            delta += step;
+        }
+        step >>= 1;
+        if (diff >= step)
+        {
+            code |= 2;
+            diff -= step;
+            delta += step;
+        }
+        step >>= 1;
+        if (diff >= step)
+        {
+            code |= 1;
+            delta += step;
+        }
+        prev += code & 8 ? -delta : delta;
+        prev = prev < 0 ? 0 : prev > 255 ? 255 : prev;
+        index += adpcm_index[code];
+        index = index < 0 ? 0 : index > 88 ? 88 : index;
+        if (i % 2 == 0)
+            out[i / 2] = code << 4;
+        else
+            out[i / 2] |= code;
+    }
+    return (n + 1) / 2;
+}
+
+// Decode n bytes of ADPCM into 2 * n unsigned 8-bit samples, the same way
+// the EV3 firmware does
+static void adpcm_decode(const unsigned char *in, int n, unsigned char *out)
+{
+    int prev = 0x7F, index = 20;
+    for (int i = 0; i < 2 * n; i += 1)
+    {
+        int code = i % 2 == 0 ? in[i / 2] >> 4 : in[i / 2] & 0x0F;
+        int step = adpcm_steps[index];
+        int delta = step >> 3;
+        if (code & 4)
+            delta += step;
+        if (code & 2)
+            delta += step >> 1;
+        if (code & 1)
+            delta += step >> 2;
+        prev += code & 8 ? -delta : delta;
+        prev = prev < 0 ? 0 : prev > 255 ? 255 : prev;
+        index += adpcm_index[code];
+        index = index < 0 ? 0 : index > 88 ? 88 : index;
+        out[i] = prev;
+    }
+}
+
+int rsf_encode(const short *samples, int n, int rate, struct rsf_profile *profile)
+{
+    char path[1024];
+    int per_segment = profile->format == RSF_FORMAT_ADPCM ? 2 * RSF_MAX_PAYLOAD : RSF_MAX_PAYLOAD;
+    unsigned char *pcm = malloc((long long)n * profile->rate / rate + 1);
+    unsigned char *buffer = malloc(RSF_MAX_PAYLOAD);
+
+    profile->segment_cnt = 0;
+    profile->changed = NULL;
+    if (pcm == NULL || buffer == NULL)
+    {
+        free(pcm);
+        free(buffer);
+        return -1;
+    }
+    int m = resample_u8(samples, n, rate, pcm, profile->rate);
+    int segment_cnt = (m + per_segment - 1) / per_segment;
+    profile->changed = malloc(segment_cnt + 1);
+    if (profile->changed == NULL)
+    {
+        free(pcm);
+        free(buffer);
+        return -1;
+    }
+    for (int i = 0; i < segment_cnt; i += 1)
+    {
+        const unsigned char *data = pcm + (long long)i * per_segment;
+        int size = m - i * per_segment < per_segment ? m - i * per_segment : per_segment;
+        if (profile->format == RSF_FORMAT_ADPCM)
+        {
+            size = adpcm_encode(data, size, buffer);
+            data = buffer;
+        }
+        int written = -1;
+        if (snprintf(path, sizeof(path), "%s_%d.rsf", profile->name, i + 1) < (int)sizeof(path))
+            written = rsf_write_segment(path, data, size, profile->rate, profile->format);
+        else
+            debug("Error: Path too long for %s.\n", profile->name);
+        if (written < 0)
+        {
+            free(pcm);
+            free(buffer);
+            return -1;
+        }
+        profile->changed[i] = written;
+    }
+    free(pcm);
+    free(buffer);
+
+    // Remove segments left over from a longer version of the same file
+    for (int i = segment_cnt + 1;; i += 1)
+    {
+        if (snprintf(path, sizeof(path), "%s_%d.rsf", profile->name, i) >= (int)sizeof(path) || unlink(path) != 0)
+            break;
+    }
+    profile->segment_cnt = segment_cnt;
+    return segment_cnt;
+}
+
+struct encode_job
+{
+    const short *samples;
+    int n, rate;
+    struct rsf_profile *profile;
+};
+
+static void *encode_worker(void *arg)
+{
+    struct encode_job *job = arg;
+    rsf_encode(job->samples, job->n, job->rate, job->profile);
+    return NULL;
+}
+
+int rsf_convert_profiles(const char *src, struct rsf_profile *profiles, int cnt, double peak)
+{
+    short *samples;
+    int rate = 0, ret = 0;
+
+    // Decode once at the highest rate any profile needs
+    for (int i = 0; i < cnt; i += 1)
+        if (profiles[i].rate > rate)
+            rate = profiles[i].rate;
+    int n = rsf_decode(src, rate, &samples);
+    if (n < 0)
+        return -1;
+    if (peak != 0)
+        rsf_normalize(samples, n, rate, peak);
+
+    pthread_t threads[cnt];
+    struct encode_job jobs[cnt];
+    for (int i = 0; i < cnt; i += 1)
+    {
+        jobs[i].samples = samples;
+        jobs[i].n = n;
+        jobs[i].rate = rate;
+        jobs[i].profile = &profiles[i];
+        if (cnt == 1)
+            encode_worker(&jobs[i]);
+        else
+            pthread_create(&threads[i], NULL, encode_worker, &jobs[i]);
+    }
+    for (int i = 0; i < cnt; i += 1)
+    {
+        if (cnt > 1)
+            pthread_join(threads[i], NULL);
+        if (profiles[i].segment_cnt <= 0)
+        {
+            debug("Error: Cannot write %s.\n", profiles[i].name);
+            ret = -1;
+        }
+    }
+    free(samples);
+    return ret;
+}
+
+int rsf_convert(const char *src, const char *name, char **changed)
+{
+    struct rsf_profile profile;
+    profile.rate = RSF_SAMPLE_RATE;
+    profile.format = RSF_FORMAT_PCM;
+    if (snprintf(profile.name, sizeof(profile.name), "%s", name) >= (int)sizeof(profile.name))
+    {
+        debug("Error: Name too long for %s.\n", src);
+        return -1;
+    }
+    if (rsf_convert_profiles(src, &profile, 1, 0) != 0)
+    {
+        free(profile.changed);
+        return -1;
+    }
+    if (changed != NULL)
+        *changed = profile.changed;
+    else
+        free(profile.changed);
+    return profile.segment_cnt;
+}
+
+int rsf_read_header(const char *path, int *format, int *size, int *rate)
+{
+    unsigned char header[RSF_HEADER_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int len = read(fd, header, RSF_HEADER_SIZE);
+    close(fd);
+    if (len != RSF_HEADER_SIZE)
+        return -1;
+    *format = header[0] << 8 | header[1];
+    *size = header[2] << 8 | header[3];
+    *rate = header[4] << 8 | header[5];
+    return 0;
+}
+
+double rsf_duration(const char *path)
+{
+    int format, size, rate;
+    if (rsf_read_header(path, &format, &size, &rate) != 0 || rate == 0)
+        return -1;
+    return (format == RSF_FORMAT_ADPCM ? 2.0 * size : size) / rate;
+}
+
+int rsf_open(const char *path, struct rsf_file *file)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    file->length = st.st_size;
+    file->map = NULL;
+    if (file->length > 0)
+        file->map = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED)
+        return -1;
+
+    const unsigned char *header = file->map;
+    file->format = file->size = file->rate = 0;
+    file->data = header + RSF_HEADER_SIZE;
+    if (file->length >= RSF_HEADER_SIZE)
+    {
+        file->format = header[0] << 8 | header[1];
+        file->size = header[2] << 8 | header[3];
+        file->rate = header[4] << 8 | header[5];
+    }
+    return 0;
+}
+
+void rsf_close(struct rsf_file *file)
+{
+    if (file->map != NULL)
+        munmap(file->map, file->length);
+    file->map = NULL;
+}
+
+int rsf_check(const struct rsf_file *file)
+{
+    const unsigned char *header = file->map;
+    if (file->length < RSF_HEADER_SIZE)
+        return RSF_SHORT;
+    if (file->format != RSF_FORMAT_PCM && file->format != RSF_FORMAT_ADPCM)
+        return RSF_BAD_FORMAT;
+    if (file->rate < 1000)
+        return RSF_BAD_RATE;
+    if (header[6] != 0 || header[7] != 0)
+        return RSF_BAD_HEADER;
+    if (file->length < RSF_HEADER_SIZE + file->size)
+        return RSF_TRUNCATED;
+    if (file->length > RSF_HEADER_SIZE + file->size)
+        return RSF_TRAILING;
+    return RSF_OK;
+}
+
+const char *rsf_problem(int problem)
+{
+    static const char *problems[] = {"ok",
+                                      "shorter than the header",
+                                      "unknown format",
+                                      "invalid sample rate",
+                                      "reserved header bytes not zero",
+                                      "fewer bytes than the header says",
+                                      "more bytes than the header says"};
+    return problem >= RSF_OK && problem <= RSF_TRAILING ? problems[problem] : "unknown problem";
+}
+
+// Decode the sound of file into malloc'd unsigned 8-bit samples, reading no
+// further than the end of the file. Returns the number of samples.
+static int decode_u8(const struct rsf_file *file, unsigned char **samples)
+{
+    long available = file->length - RSF_HEADER_SIZE;
+    int size = available < file->size ? (available < 0 ? 0 : available) : file->size;
+    int n = file->format == RSF_FORMAT_ADPCM ? 2 * size : size;
+    *samples = malloc(n > 0 ? n : 1);
+    if (*samples == NULL)
+        return -1;
+    if (file->format == RSF_FORMAT_ADPCM)
+        adpcm_decode(file->data, size, *samples);
+    else
+        memcpy(*samples, file->data, size);
+    return n;
+}
+
+static void put_le(unsigned char *at, unsigned int value, int bytes)
+{
+    for (int i = 0; i < bytes; i += 1)
+        at[i] = value >> 8 * i;
+}
+
+int rsf_write_wav(const struct rsf_file *file, const char *dest)
+{
+    unsigned char *samples, header[44];
+    int n = decode_u8(file, &samples);
+    if (n < 0)
+        return -1;
+
+    // 8-bit mono PCM, which is unsigned in WAV as well
+    memcpy(header, "RIFF    WAVEfmt ", 16);
+    put_le(header + 4, 36 + n, 4);
+    put_le(header + 16, 16, 4);
+    put_le(header + 20, 1, 2);
+    put_le(header + 22, 1, 2);
+    put_le(header + 24, file->rate, 4);
+    put_le(header + 28, file->rate, 4);
+    put_le(header + 32, 1, 2);
+    put_le(header + 34, 8, 2);
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, n, 4);
+    FILE *out = fopen(dest, "wb");
+    int ok = out != NULL && fwrite(header, 1, 44, out) == 44 && fwrite(samples, 1, n, out) == (size_t)n;
+    if (out != NULL && fclose(out) != 0)
+        ok = 0;
+    free(samples);
+    return ok ? 0 : -1;
+}
+
+int rsf_write_tail(const char *src, int offset, int count, const char *dest)
+{
+    struct rsf_file file;
+    unsigned char *samples;
+    if (rsf_open(src, &file) != 0)
+        return -1;
+    int n = rsf_check(&file) == RSF_OK ? decode_u8(&file, &samples) : -1;
+    rsf_close(&file);
+    if (n < 0)
+        return -1;
+    if (offset < 0 || offset >= n || count < 1)
+    {
+        free(samples);
+        return -1;
+    }
+
+    // ADPCM can only be decoded from the start, so the tail is always PCM,
+    // which holds at most RSF_MAX_PAYLOAD samples
+    if (count > n - offset)
+        count = n - offset;
+    if (count > RSF_MAX_PAYLOAD)
+        count = RSF_MAX_PAYLOAD;
+    int written = rsf_write_segment(dest, samples + offset, count, file.rate, RSF_FORMAT_PCM);
+    free(samples);
+    return written < 0 ? -1 : 0;
+}
+
+unsigned long long rsf_hash(const unsigned char *data, int size)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < size; i += 1)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 1 if the file at path holds exactly size bytes of data
+static int same_content(const char *path, const unsigned char *data, int size)
+{
+    struct rsf_file file;
+    if (rsf_open(path, &file) != 0)
+        return 0;
+    int same = file.length == size && (size == 0 || memcmp(file.map, data, size) == 0);
+    rsf_close(&file);
+    return same;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+int rsf_is_shared(const char *file)
+{
+    return strlen(file) == 21 && file[0] == 's' && strspn(file + 1, "0123456789abcdef") == 16 &&
+           strcmp(file + 17, ".rsf") == 0;
+}
+
+// Remove the shared segments in the first dir_len characters of dir that no
+// manifest there lists any more
+static void remove_orphans(const char *dir, int dir_len)
+{
+    char path[1024], (*used)[RSF_SHARED_NAME] = NULL;
+    int used_cnt = 0, used_max = 0, cnt;
+    struct dirent *entry;
+
+    snprintf(path, sizeof(path), "%.*s", dir_len, dir);
+    DIR *d = opendir(dir_len > 0 ? path : ".");
+    if (d == NULL)
+        return;
+    while ((entry = readdir(d)) != NULL)
+    {
+        int len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".lst") != 0 ||
+            snprintf(path, sizeof(path), "%.*s%.*s", dir_len, dir, len - 4, entry->d_name) >= (int)sizeof(path))
+            continue;
+        // A manifest that fills the room left may have been cut short
+        while ((cnt = rsf_read_manifest(path, used + used_cnt, used_max - used_cnt)) == used_max - used_cnt)
+        {
+            void *grown = realloc(used, (used_max + 1024) * sizeof(*used));
+            if (grown == NULL)
+            {
+                // Without the full list nothing can safely be removed
+                free(used);
+                closedir(d);
+                return;
+            }
+            used = grown;
+            used_max += 1024;
+        }
+        used_cnt += cnt > 0 ? cnt : 0;
+    }
+    if (used_cnt > 0)
+        qsort(used, used_cnt, RSF_SHARED_NAME, compare_names);
+
+    rewinddir(d);
+    while ((entry = readdir(d)) != NULL)
+    {
+        char name[RSF_SHARED_NAME];
+        if (!rsf_is_shared(entry->d_name))
+            continue;
+        snprintf(name, sizeof(name), "%.17s", entry->d_name);
+        if (used_cnt > 0 && bsearch(name, used, used_cnt, RSF_SHARED_NAME, compare_names) != NULL)
+            continue;
+        if (snprintf(path, sizeof(path), "%.*s%s", dir_len, dir, entry->d_name) < (int)sizeof(path))
+            unlink(path);
+    }
+    closedir(d);
+    free(used);
+}
+
+int rsf_share_segments(const char *name, int segment_cnt)
+{
+    char path[1024], shared[1024];
+    int dir_len = strrchr(name, '/') == NULL ? 0 : strrchr(name, '/') - name + 1;
+
+    if (snprintf(path, sizeof(path), "%s.lst", name) >= (int)sizeof(path))
+        return -1;
+    FILE *manifest = fopen(path, "w");
+    if (manifest == NULL)
+    {
+        debug("Error: Cannot open manifest %s.\n", path);
+        return -1;
+    }
+    for (int i = 1; i <= segment_cnt; i += 1)
+    {
+        snprintf(path, sizeof(path), "%s_%d.rsf", name, i);
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            debug("Error: Cannot open %s.\n", path);
+            fclose(manifest);
+            return -1;
+        }
+        unsigned char *data = malloc(st.st_size);
+        int size = data == NULL ? -1 : read(fd, data, st.st_size);
+        close(fd);
+        if (size != st.st_size)
+        {
+            free(data);
+            fclose(manifest);
+            return -1;
+        }
+
+        // The shared copy is a hard link, so it costs no extra space locally.
+        // A different segment that happens to have the same hash moves on to
+        // the next free name, so the names stay unique.
+        unsigned long long hash = rsf_hash(data, size);
+        while (1)
+        {
+            snprintf(shared, sizeof(shared), "%.*ss%016llx.rsf", dir_len, name, hash);
+            if (access(shared, F_OK) != 0)
+            {
+                if (link(path, shared) != 0)
+                {
+                    debug("Error: Cannot create %s.\n", shared);
+                    free(data);
+                    fclose(manifest);
+                    return -1;
+                }
+                break;
+            }
+            if (same_content(shared, data, size))
+                break;
+            hash += 1;
+        }
+        free(data);
+        fprintf(manifest, "s%016llx\n", hash);
+    }
+    fclose(manifest);
+    remove_orphans(name, dir_len);
+    return 0;
+}
+
+int rsf_read_manifest(const char *name, char segments[][RSF_SHARED_NAME], int max)
+{
+    char path[1024], line[RSF_SHARED_NAME];
+    int segment_cnt = 0;
+
+    if (snprintf(path, sizeof(path), "%s.lst", name) >= (int)sizeof(path))
+        return -1;
+    FILE *manifest = fopen(path, "r");
+    if (manifest == NULL)
+        return -1;
+    while (segment_cnt < max && fgets(line, sizeof(line), manifest) != NULL)
+    {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] != 0)
+            strcpy(segments[segment_cnt++], line);
+    }
+    fclose(manifest);
+    return segment_cnt;
+}
+
+// Upload timings of this run, as sums for the least squares fit of
+// time = rtt * round trips + bytes / throughput
+static double fit_rr, fit_rb, fit_bb, fit_rt, fit_bt;
+static int fit_cnt;
+
+static int round_trips(long bytes)
+{
+    return 1 + (bytes + PARTITION_SIZE - 1) / PARTITION_SIZE;
+}
+
+int rsf_upload_to(const char *src, const char *dest)
+{
+    struct stat st;
+    struct timespec t0, t1;
+    struct rsf_file file;
+    const char *ext = strrchr(src, '.');
+
+    // Never send a damaged sound file, the EV3 would only play noise or hang
+    if (ext != NULL && strcmp(ext, ".rsf") == 0)
+    {
+        int problem = RSF_SHORT;
+        if (rsf_open(src, &file) == 0)
+        {
+            problem = rsf_check(&file);
+            rsf_close(&file);
+        }
+        if (problem != RSF_OK)
+        {
+            debug("Error: %s: %s, not uploading it.\n", src, rsf_problem(problem));
+            return CORRUPT_FILE;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = BT_upload_file(dest, src);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if ((ret == SUCCESS || ret == END_OF_FILE) && stat(src, &st) == 0)
+    {
+        double r = round_trips(st.st_size), b = st.st_size;
+        double t = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        fit_rr += r * r;
+        fit_rb += r * b;
+        fit_bb += b * b;
+        fit_rt += r * t;
+        fit_bt += b * t;
+        fit_cnt += 1;
+    }
+    return ret;
+}
+
+int rsf_upload(const char *src)
+{
+    char dest[1024];
+    const char *base = strrchr(src, '/');
+    base = base == NULL ? src : base + 1;
+    if (snprintf(dest, sizeof(dest), RSF_SOUND_DIR "%s", base) >= (int)sizeof(dest))
+    {
+        debug("Error: Path too long for %s.\n", src);
+        return -1;
+    }
+    debug("%s\n%s\n", dest, src);
+    return rsf_upload_to(src, dest);
+}
+
+static void link_file(char *path, int size)
+{
+    const char *home = getenv("HOME");
+    snprintf(path, size, "%s/" RSF_LINK_FILE, home == NULL ? "." : home);
+}
+
+int rsf_load_link(const char *bt_id, struct rsf_link *link)
+{
+    char path[1024], id[64];
+    double rr, rb, bb, rt, bt;
+    int cnt;
+
+    link->rtt = RSF_DEFAULT_RTT;
+    link->throughput = RSF_DEFAULT_THROUGHPUT;
+    link->uploads = 0;
+    link_file(path, sizeof(path));
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return -1;
+    flock(fileno(in), LOCK_SH);
+    while (fscanf(in, "%63s %d %lf %lf %lf %lf %lf", id, &cnt, &rr, &rb, &bb, &rt, &bt) == 7)
+    {
+        if (strcmp(id, bt_id) != 0 || cnt == 0)
+            continue;
+        double det = rr * bb - rb * rb;
+        double rtt = det > 1e-6 * rr * bb ? (rt * bb - bt * rb) / det : -1;
+        double per_byte = det > 1e-6 * rr * bb ? (rr * bt - rb * rt) / det : -1;
+
+        // Uploads of similar sizes cannot tell the two apart, then keep the
+        // default round trip time and put the rest down to throughput
+        if (rtt < 0 || per_byte <= 0)
+        {
+            rtt = RSF_DEFAULT_RTT;
+            per_byte = (bt - rtt * rb) / bb;
+            if (per_byte <= 0)
+            {
+                rtt = 0;
+                per_byte = bt / bb;
+            }
+        }
+        link->rtt = rtt;
+        link->throughput = 1 / per_byte;
+        link->uploads = cnt;
+    }
+    fclose(in);
+    return link->uploads > 0 ? 0 : -1;
+}
+
+void rsf_save_link(const char *bt_id)
+{
+    char path[1024], line[512], id[64], *text = NULL;
+    size_t text_len = 0;
+    double rr, rb, bb, rt, bt;
+    int cnt;
+
+    if (fit_cnt == 0)
+        return;
+
+    // Several processes may save at the same time, such as the uploaders of
+    // rsfWatch or rsf_upload_all(), so the file is rewritten in place while
+    // holding a lock on it
+    link_file(path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "r+");
+    FILE *out = open_memstream(&text, &text_len);
+    if (file == NULL || out == NULL)
+    {
+        if (file != NULL)
+            fclose(file);
+        else if (fd >= 0)
+            close(fd);
+        if (out != NULL)
+            fclose(out);
+        free(text);
+        return;
+    }
+    flock(fd, LOCK_EX);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "%63s %d %lf %lf %lf %lf %lf", id, &cnt, &rr, &rb, &bb, &rt, &bt) == 7 && strcmp(id, bt_id) == 0)
+        {
+            fit_cnt += cnt;
+            fit_rr += rr;
+            fit_rb += rb;
+            fit_bb += bb;
+            fit_rt += rt;
+            fit_bt += bt;
+        }
+        else
+            fputs(line, out);
+    }
+    fprintf(out, "%s %d %g %g %g %g %g\n", bt_id, fit_cnt, fit_rr, fit_rb, fit_bb, fit_rt, fit_bt);
+    fclose(out);
+    fit_cnt = 0;
+    fit_rr = fit_rb = fit_bb = fit_rt = fit_bt = 0;
+    rewind(file);
+    fwrite(text, 1, text_len, file);
+    fflush(file);
+    ftruncate(fd, text_len);
+    fclose(file);
+    free(text);
+}
+
+double rsf_upload_time(const struct rsf_link *link, long bytes)
+{
+    return round_trips(bytes) * link->rtt + bytes / link->throughput;
+}
+
+double rsf_probe(const char *src)
+{
+    char cmd[4096] = "ffprobe -v error -show_entries format=duration -of csv=p=0 ";
+    double duration = -1;
+    // Quoting makes the path at most four times longer
+    if (strlen(cmd) + 4 * strlen(src) + 3 > sizeof(cmd))
+    {
+        debug("Error: Path too long for %s.\n", src);
+        return -1;
+    }
+    quote_path(cmd, src);
+    FILE *in = popen(cmd, "r");
+    if (in == NULL)
+        return -1;
+    if (fscanf(in, "%lf", &duration) != 1)
+        duration = -1;
+    if (pclose(in) != 0)
+        duration = -1;
+    return duration;
+}
+
+// One upload path of rsf_upload_all(): a child process with its own
+// connection, fed the indexes of the files to send through a pipe
+struct upload_path
+{
+    pid_t pid;
+    int cmd_fd, result_fd;
+    int busy;          // file being sent, or -1
+    double started;    // when it was sent
+    struct rsf_link link;
+    long bytes;        // sent so far, and how long it took
+    double seconds;
+};
+
+static double monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void upload_child(const char *bt_id, int wifi, const char **files, int cmd_fd, int result_fd)
+{
+    char line[64], key[64];
+    int i;
+    FILE *in = fdopen(cmd_fd, "r");
+
+    // The Bluetooth path keeps the connection inherited from the parent
+    if (wifi && BT_open_wifi(bt_id) != 0)
+    {
+        dprintf(result_fd, "-1 -1 0\n");
+        _exit(-1);
+    }
+    while (fgets(line, sizeof(line), in) != NULL && sscanf(line, "%d", &i) == 1)
+    {
+        double start = monotonic_now();
+        int status = rsf_upload(files[i]);
+        dprintf(result_fd, "%d %d %f\n", i, status, monotonic_now() - start);
+    }
+    snprintf(key, sizeof(key), wifi ? "%s/wifi" : "%s", bt_id);
+    rsf_save_link(key);
+    if (wifi)
+        BT_close();
+    _exit(0);
+}
+
+// Check the files against the listing of the sound folder, which gives the
+// size of each file. Returns the number of files confirmed, or -1 if the
+// listing could not be read.
+static int verify_uploads(const char **files, int cnt, char *confirmed)
+{
+    char *listing, md5[33], name[1024];
+    struct stat st;
+    unsigned int size;
+    int n, found = 0;
+
+    int status = BT_list_files(RSF_SOUND_DIR, &listing);
+    if (status != SUCCESS && status != END_OF_FILE)
+        return -1;
+    memset(confirmed, 0, cnt);
+    for (char *line = listing; *line != 0; line += n)
+    {
+        n = strcspn(line, "\n");
+        if (sscanf(line, "%32s %x %1023[^\n]", md5, &size, name) == 3)
+        {
+            for (int i = 0; i < cnt; i += 1)
+            {
+                const char *base = strrchr(files[i], '/');
+                base = base == NULL ? files[i] : base + 1;
+                if (!confirmed[i] && strcmp(base, name) == 0 && stat(files[i], &st) == 0 && st.st_size == size)
+                {
+                    confirmed[i] = 1;
+                    found += 1;
+                }
+            }
+        }
+        n += line[n] == '\n';
+    }
+    free(listing);
+    return found;
+}
+
+int rsf_upload_all(const char *bt_id, const char **files, int cnt, int wifi)
+{
+    struct upload_path paths[2];
+    int path_cnt = wifi ? 2 : 1, alive = path_cnt, next = 0, done = 0;
+    int *order = malloc(cnt * sizeof(int));
+    long *size = malloc(cnt * sizeof(long));
+    char *confirmed = malloc(cnt);
+    struct stat st;
+
+    if (order == NULL || size == NULL || confirmed == NULL)
+    {
+        free(order);
+        free(size);
+        free(confirmed);
+        return -1;
+    }
+
+    // Largest files first, so the last ones to finish are small
+    for (int i = 0; i < cnt; i += 1)
+    {
+        size[i] = stat(files[i], &st) == 0 ? st.st_size : 0;
+        int k = i;
+        while (k > 0 && size[order[k - 1]] < size[i])
+        {
+            order[k] = order[k - 1];
+            k -= 1;
+        }
+        order[k] = i;
+    }
+
+    fflush(NULL);
+    for (int p = 0; p < path_cnt; p += 1)
+    {
+        int cmd[2], result[2];
+        char key[64];
+        pipe(cmd);
+        pipe(result);
+        snprintf(key, sizeof(key), p == 1 ? "%s/wifi" : "%s", bt_id);
+        rsf_load_link(key, &paths[p].link);
+        paths[p].busy = -1;
+        paths[p].bytes = 0;
+        paths[p].seconds = 0;
+        paths[p].pid = fork();
+        if (paths[p].pid == 0)
+        {
+            close(cmd[1]);
+            close(result[0]);
+            for (int q = 0; q < p; q += 1)
+            {
+                close(paths[q].cmd_fd);
+                close(paths[q].result_fd);
+            }
+            upload_child(bt_id, p == 1, files, cmd[0], result[1]);
+        }
+        close(cmd[0]);
+        close(result[1]);
+        paths[p].cmd_fd = cmd[1];
+        paths[p].result_fd = result[0];
+    }
+
+    while (done < cnt && alive > 0)
+    {
+        // Hand the next file to the idle paths, fastest first. A slow path
+        // is left idle if a faster one would still finish the file sooner
+        // after the one it is sending now.
+        for (int p = 0; p < path_cnt && next < cnt; p += 1)
+        {
+            int fastest = p;
+            for (int q = 0; q < path_cnt; q += 1)
+                if (paths[q].busy == -1 && paths[q].pid > 0 && paths[q].link.throughput > paths[fastest].link.throughput)
+                    fastest = q;
+            struct upload_path *path = &paths[fastest];
+            if (path->busy != -1 || path->pid <= 0)
+                continue;
+            int file = order[next];
+            double finish = rsf_upload_time(&path->link, size[file]);
+            int wait = 0;
+            for (int q = 0; q < path_cnt; q += 1)
+            {
+                struct upload_path *other = &paths[q];
+                if (q == fastest || other->busy == -1 || other->pid <= 0)
+                    continue;
+                double left = other->started + rsf_upload_time(&other->link, size[other->busy]) - monotonic_now();
+                if ((left > 0 ? left : 0) + rsf_upload_time(&other->link, size[file]) < finish)
+                    wait = 1;
+            }
+            if (wait)
+                continue;
+            path->busy = file;
+            path->started = monotonic_now();
+            dprintf(path->cmd_fd, "%d\n", file);
+            next += 1;
+        }
+
+        struct pollfd pfd[2];
+        for (int p = 0; p < path_cnt; p += 1)
+            pfd[p] = (struct pollfd){paths[p].pid > 0 ? paths[p].result_fd : -1, POLLIN, 0};
+        if (poll(pfd, path_cnt, -1) < 0)
+            break;
+        for (int p = 0; p < path_cnt; p += 1)
+        {
+            char line[64];
+            int file, status, n;
+            double seconds;
+            if (pfd[p].revents == 0)
+                continue;
+            n = read(paths[p].result_fd, line, sizeof(line) - 1);
+            line[n > 0 ? n : 0] = 0;
+            if (n <= 0 || sscanf(line, "%d %d %lf", &file, &status, &seconds) != 3 || file < 0)
+            {
+                // The path is gone, its file goes back to the queue
+                debug("Warning: %s upload path closed.\n", p == 1 ? "WiFi" : "Bluetooth");
+                if (paths[p].busy != -1)
+                    order[--next] = paths[p].busy;
+                close(paths[p].cmd_fd);
+                close(paths[p].result_fd);
+                waitpid(paths[p].pid, NULL, 0);
+                paths[p].pid = -1;
+                paths[p].busy = -1;
+                alive -= 1;
+                continue;
+            }
+            debug("[%s] %s: %d\n", p == 1 ? "WiFi" : "Bluetooth", files[file], status);
+            paths[p].bytes += size[file];
+            paths[p].seconds += seconds;
+            if (paths[p].seconds > 0)
+                paths[p].link.throughput = paths[p].bytes / paths[p].seconds;
+            paths[p].busy = -1;
+            done += 1;
+        }
+    }
+
+    for (int p = 0; p < path_cnt; p += 1)
+    {
+        if (paths[p].pid <= 0)
+            continue;
+        close(paths[p].cmd_fd);
+        close(paths[p].result_fd);
+        waitpid(paths[p].pid, NULL, 0);
+        if (paths[p].seconds > 0)
+            debug("%s: %.1f KB/s\n", p == 1 ? "WiFi" : "Bluetooth", paths[p].bytes / paths[p].seconds / 1024);
+    }
+
+    // Whatever the listing does not show is sent again over Bluetooth
+    int missing = 0, found = verify_uploads(files, cnt, confirmed);
+    for (int i = 0; i < cnt && found >= 0; i += 1)
+    {
+        if (confirmed[i])
+            continue;
+        debug("%s is missing on the EV3, sending it again.\n", files[i]);
+        int status = rsf_upload(files[i]);
+        missing += status != SUCCESS && status != END_OF_FILE;
+    }
+    if (found < 0)
+        debug("Warning: Cannot list the sound folder, the uploads were not verified.\n");
+    free(order);
+    free(size);
+    free(confirmed);
+    return missing;
+}
+
+int rsf_upload_segment(const char *name, int i)
+{
+    char src[1024];
+    if (snprintf(src, sizeof(src), "%s_%d.rsf", name, i) >= (int)sizeof(src))
+    {
+        debug("Error: Path too long for %s.\n", name);
+        return -1;
+    }
+    return rsf_upload(src);
+}
@@ -0,0 +1,183 @@
+#ifndef __rsf_header
+#define __rsf_header
+
+#include <stdio.h>
+
+#define debug(...) fprintf(stderr, __VA_ARGS__)
+
+// An .rsf file is an 8-byte header followed by the sound data:
+//   |0x01:0x00|  |size hi:size lo|  |rate hi:rate lo|  |0x00:0x00|
+//    format        payload bytes       sample rate
+// The 16-bit size field limits each file to 65535 bytes of sound, which at
+// 8 kHz unsigned 8-bit PCM is about 8 seconds. The ADPCM format packs two
+// 4-bit IMA codes per byte, high nibble first, so the same file holds twice
+// as many samples.
+#define RSF_HEADER_SIZE 8
+#define RSF_MAX_PAYLOAD 65535
+#define RSF_SAMPLE_RATE 8000
+#define RSF_FORMAT_PCM 0x0100
+#define RSF_FORMAT_ADPCM 0x0101
+
+// One output variant of a converted file
+struct rsf_profile
+{
+    int rate;        // sample rate in Hz
+    int format;      // RSF_FORMAT_PCM or RSF_FORMAT_ADPCM
+    char name[1024]; // segments are written to name_1.rsf ... name_n.rsf
+    int segment_cnt; // filled in by rsf_encode()
+    char *changed;   // filled in by rsf_encode(), one malloc'd flag per segment
+};
+
+// Where the EV3 looks for sound files
+#define RSF_SOUND_DIR "/home/root/lms2012/prjs/sound/"
+
+// Strip the extension from path, leaving the result in name
+void rsf_base_name(char *name, const char *path);
+
+// Decode src into signed 16-bit mono samples at the given rate. samples
+// receives a malloc'd buffer. Returns the number of samples, or -1 on error.
+int rsf_decode(const char *src, int rate, short **samples);
+
+// Resample, encode and segment n decoded samples according to profile. The
+// samples are only read, so several profiles can share one decoded buffer.
+// Returns the number of segments, or -1 on error.
+int rsf_encode(const short *samples, int n, int rate, struct rsf_profile *profile);
+
+// Scale n samples in place so the loudest parts reach peak (a fraction of
+// full scale), boosting by at most RSF_MAX_GAIN. The gain is chosen per 10 ms
+// block from a short lookahead window, so it drops ahead of transients instead
+// of clipping them and recovers slowly afterwards.
+#define RSF_MAX_GAIN 16.0
+void rsf_normalize(short *samples, int n, int rate, double peak);
+
+// Decode src once and encode it for every profile in parallel. If peak is
+// not 0, the decoded samples are normalized to it first.
+// Returns 0 on success, or -1 if the decode or any profile failed.
+int rsf_convert_profiles(const char *src, struct rsf_profile *profiles, int cnt, double peak);
+
+// Convert src into name_1.rsf ... name_n.rsf. Segments whose content did not
+// change are left untouched, and stale segments from an older, longer version
+// are removed. If changed is not NULL, it receives a malloc'd array with one
+// flag per segment (1 if that segment was rewritten).
+// Returns the number of segments, or -1 on error.
+int rsf_convert(const char *src, const char *name, char **changed);
+
+// Write one segment file, skipping the write if the file already holds the
+// same data. Returns 1 if written, 0 if unchanged, -1 on error (including a
+// size above RSF_MAX_PAYLOAD).
+int rsf_write_segment(const char *path, const unsigned char *data, int size, int rate, int format);
+
+// Read the header of an .rsf file. Returns 0 on success, or -1 on error.
+int rsf_read_header(const char *path, int *format, int *size, int *rate);
+
+// Playing time of an .rsf file in seconds, or -1 on error
+double rsf_duration(const char *path);
+
+// Write count samples of the sound of src from sample offset onwards to
+// dest, as PCM, or all of the rest if there are fewer. At most
+// RSF_MAX_PAYLOAD samples fit in one PCM segment.
+// Returns 0 on success, or -1 on error.
+int rsf_write_tail(const char *src, int offset, int count, const char *dest);
+
+// An .rsf file mapped into memory by rsf_open(). The header fields are 0 if
+// the file is shorter than the header.
+struct rsf_file
+{
+    int format, size, rate;
+    long length;               // bytes in the file
+    const unsigned char *data; // the sound, length - RSF_HEADER_SIZE bytes
+    void *map;
+};
+
+// Problems found by rsf_check()
+#define RSF_OK 0
+#define RSF_SHORT 1      // shorter than the header
+#define RSF_BAD_FORMAT 2 // neither PCM nor ADPCM
+#define RSF_BAD_RATE 3   // below 1000 Hz
+#define RSF_BAD_HEADER 4 // reserved bytes 6 and 7 not zero
+#define RSF_TRUNCATED 5  // fewer bytes than the size field says
+#define RSF_TRAILING 6   // more bytes than the size field says, typically an
+                         // older, longer file that was overwritten in place
+
+// Map an .rsf file read-only. Returns 0 on success, or -1 on error.
+int rsf_open(const char *path, struct rsf_file *file);
+void rsf_close(struct rsf_file *file);
+
+// Validate the header of a mapped file against its size. Returns RSF_OK or
+// the problem found.
+int rsf_check(const struct rsf_file *file);
+
+// Description of a problem returned by rsf_check()
+const char *rsf_problem(int problem);
+
+// Decode a mapped file to an 8-bit mono .wav at dest, so it can be listened
+// to. A truncated file is decoded as far as it goes. Returns 0 on success, or
+// -1 on error.
+int rsf_write_wav(const struct rsf_file *file, const char *dest);
+
+// Segment deduplication: identical segments are stored once, as
+// s<hash>.rsf where hash is the 64-bit FNV-1a hash of the whole file, and
+// each track gets a manifest name.lst listing the shared names of its
+// segments in order, one per line and without the extension.
+#define RSF_SHARED_NAME 32
+unsigned long long rsf_hash(const unsigned char *data, int size);
+
+// Link name_1.rsf ... name_n.rsf to their shared names next to them and write
+// name.lst. Returns 0 on success, or -1 on error.
+int rsf_share_segments(const char *name, int segment_cnt);
+
+// Read up to max shared segment names from name.lst.
+// Returns the number of segments, or -1 if there is no manifest.
+int rsf_read_manifest(const char *name, char segments[][RSF_SHARED_NAME], int max);
+
+// 1 if file is the name of a shared segment, s<16 hex digits>.rsf
+int rsf_is_shared(const char *file);
+
+// Upload src to dest on the connected EV3, timing it for the link profile.
+// .rsf files are checked first and not sent if rsf_check() finds a problem.
+// Returns the BT_upload_file() status, or CORRUPT_FILE.
+int rsf_upload_to(const char *src, const char *dest);
+
+// Upload a local file to the sound folder of the connected EV3
+int rsf_upload(const char *src);
+
+// Upload files to the sound folder of the connected EV3, in order of size.
+// With wifi, a second connection is opened to the same EV3 over WiFi (see
+// BT_open_wifi()) and the files are spread over both, each going to the
+// path expected to finish it first. The sound folder is then listed and
+// files that are missing or have the wrong size are sent again over
+// Bluetooth. Returns the number of files that could not be uploaded.
+int rsf_upload_all(const char *bt_id, const char **files, int cnt, int wifi);
+
+// Link profile of an EV3: BT_upload_file() spends one round trip opening the
+// file and one per PARTITION_SIZE chunk, so an upload of b bytes takes about
+// round trips * rtt + b / throughput. The timings of every upload are kept
+// in ~/.rsfLinks, and the two parameters are fitted to them.
+#define RSF_LINK_FILE ".rsfLinks"
+#define RSF_DEFAULT_RTT 0.06
+#define RSF_DEFAULT_THROUGHPUT 40000.0
+struct rsf_link
+{
+    double rtt;        // seconds
+    double throughput; // bytes per second
+    int uploads;       // number of uploads the profile is based on
+};
+
+// Load the profile of bt_id. Returns 0 if it was measured before, or -1 if
+// the defaults had to be used.
+int rsf_load_link(const char *bt_id, struct rsf_link *link);
+
+// Add the uploads timed since the last call to the profile of bt_id
+void rsf_save_link(const char *bt_id);
+
+// Estimated time to upload a file of the given size, in seconds
+double rsf_upload_time(const struct rsf_link *link, long bytes);
+
+// Duration of an audio file in seconds from ffprobe, without decoding it.
+// Returns -1 on error.
+double rsf_probe(const char *src);
+
+// Upload name_i.rsf to the sound folder of the connected EV3
+int rsf_upload_segment(const char *name, int i);
+
+#endif
@@ -0,0 +1,201 @@
+#include "EV3_RobotControl/btcomm.h"
+#include "rsf.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_SEGMENTS 1024
+
+// .rsf files and manifests to check
+char **files;
+int file_cnt, file_max;
+
+int next_job, problem_cnt, wav;
+long long checked_bytes;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int has_ext(const char *file, const char *ext)
+{
+    const char *dot = strrchr(file, '.');
+    return dot != NULL && strcmp(dot, ext) == 0;
+}
+
+void add_file(const char *path)
+{
+    if (file_cnt == file_max)
+    {
+        file_max = file_max == 0 ? 256 : 2 * file_max;
+        files = realloc(files, file_max * sizeof(char *));
+    }
+    files[file_cnt++] = strdup(path);
+}
+
+// Collect the .rsf files and manifests under path
+void scan(const char *path)
+{
+    char child[1024];
+    struct dirent *entry;
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        add_file(path);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child))
+            continue;
+        // Some file systems do not fill in d_type
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+            scan(child);
+        else if (has_ext(entry->d_name, ".rsf") || has_ext(entry->d_name, ".lst"))
+            add_file(child);
+    }
+    closedir(dir);
+}
+
+// Check that every segment listed in a manifest is there and valid
+int check_manifest(const char *path)
+{
+    char segments[MAX_SEGMENTS][RSF_SHARED_NAME], name[1024], segment[1024];
+    int dir_len = strrchr(path, '/') == NULL ? 0 : strrchr(path, '/') - path + 1;
+    int problems = 0;
+    struct rsf_file file;
+
+    snprintf(name, sizeof(name), "%.*s", (int)(strlen(path) - 4), path);
+    int segment_cnt = rsf_read_manifest(name, segments, MAX_SEGMENTS);
+    if (segment_cnt <= 0)
+    {
+        printf("%s: empty or unreadable manifest\n", path);
+        return 1;
+    }
+    for (int i = 0; i < segment_cnt; i += 1)
+    {
+        snprintf(segment, sizeof(segment), "%.*s%s.rsf", dir_len, path, segments[i]);
+        if (rsf_open(segment, &file) != 0)
+        {
+            printf("%s: segment #%d (%s) is missing\n", path, i + 1, segments[i]);
+            problems += 1;
+            continue;
+        }
+        int problem = rsf_check(&file);
+        if (problem != RSF_OK)
+        {
+            printf("%s: segment #%d (%s) %s\n", path, i + 1, segments[i], rsf_problem(problem));
+            problems += 1;
+        }
+        rsf_close(&file);
+    }
+    return problems;
+}
+
+int check_file(const char *path)
+{
+    char dest[1024];
+    struct rsf_file file;
+
+    if (has_ext(path, ".lst"))
+        return check_manifest(path);
+    if (rsf_open(path, &file) != 0)
+    {
+        printf("%s: cannot be read\n", path);
+        return 1;
+    }
+    int problem = rsf_check(&file);
+    if (problem == RSF_TRUNCATED || problem == RSF_TRAILING)
+        printf("%s: %s (header %d bytes, file %ld bytes)\n", path, rsf_problem(problem),
+               RSF_HEADER_SIZE + file.size, file.length);
+    else if (problem != RSF_OK)
+        printf("%s: %s\n", path, rsf_problem(problem));
+    if (wav && problem != RSF_SHORT && problem != RSF_BAD_FORMAT && problem != RSF_BAD_RATE)
+    {
+        int len = strlen(path) - (has_ext(path, ".rsf") ? 4 : 0);
+        if (snprintf(dest, sizeof(dest), "%.*s.wav", len, path) >= (int)sizeof(dest))
+            debug("Error: Path too long for %s.\n", path);
+        else if (rsf_write_wav(&file, dest) != 0)
+            debug("Error: Cannot write %s.\n", dest);
+    }
+    pthread_mutex_lock(&job_lock);
+    checked_bytes += file.length;
+    pthread_mutex_unlock(&job_lock);
+    rsf_close(&file);
+    return problem != RSF_OK;
+}
+
+void *check_worker(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&job_lock);
+        int i = next_job++;
+        pthread_mutex_unlock(&job_lock);
+        if (i >= file_cnt)
+            return NULL;
+        int problems = check_file(files[i]);
+        pthread_mutex_lock(&job_lock);
+        problem_cnt += problems;
+        pthread_mutex_unlock(&job_lock);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    int jobs = 4, opt;
+
+    while ((opt = getopt(argc, (char *const *)argv, "j:w")) != -1)
+    {
+        if (opt == 'j')
+            jobs = atoi(optarg);
+        else if (opt == 'w')
+            wav = 1;
+        else
+        {
+            debug("Usage: %s [-j jobs] [-w] file_or_folder...\n", argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind < 1 || jobs < 1)
+    {
+        debug("Error: Invalid argc!\n");
+        return -1;
+    }
+
+    double start = now();
+    for (int i = optind; i < argc; i += 1)
+        scan(argv[i]);
+
+    // Only the header page of each file is read unless -w decodes it, so
+    // several workers keep the disk busy with small reads
+    pthread_t threads[jobs];
+    for (int t = 0; t < jobs; t += 1)
+        pthread_create(&threads[t], NULL, check_worker, NULL);
+    for (int t = 0; t < jobs; t += 1)
+        pthread_join(threads[t], NULL);
+
+    double elapsed = now() - start;
+    debug("%d files, %.1f MB checked in %.2f s, %d problems\n", file_cnt, checked_bytes / 1048576.0, elapsed,
+          problem_cnt);
+    for (int i = 0; i < file_cnt; i += 1)
+        free(files[i]);
+    free(files);
+    return problem_cnt == 0 ? 0 : 1;
+}
@@ -1,83 +1,327 @@
 #include "EV3_RobotControl/btcomm.h"
+#include "rsf.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define debug(...) fprintf(stderr, __VA_ARGS__)
+#define MAX_PROFILES 8
+#define MAX_SEGMENTS 1024
+#define NORMALIZE_PEAK 0.98
 
-char str[1024], name[100], buffer[65535];
+char name[1024];
+struct rsf_profile profiles[MAX_PROFILES];
 
-int main(int argc, char const *argv[])
+// Sound folder listing of the EV3, and shared segments uploaded since
+char *listing;
+char uploaded[MAX_SEGMENTS][RSF_SHARED_NAME];
+int uploaded_cnt;
+
+// Files to upload once everything is converted
+char **queue;
+int queue_cnt, queue_max;
+
+void queue_upload(const char *path)
 {
-    if (argc != 2 && argc != 3)
+    if (queue_cnt == queue_max)
     {
-        debug("Error: Invalid argc!\n");
+        queue_max = queue_max == 0 ? 256 : 2 * queue_max;
+        queue = realloc(queue, queue_max * sizeof(char *));
+    }
+    queue[queue_cnt++] = strdup(path);
+}
+
+// Parse a "rate[:pcm|adpcm]" profile, naming its output name_<rate> for PCM
+// and name_<rate>a for ADPCM
+int parse_profile(const char *arg, struct rsf_profile *profile)
+{
+    char format[16] = "pcm";
+    if (sscanf(arg, "%d:%15s", &profile->rate, format) < 1 || profile->rate < 1000 || profile->rate > 65535)
+        return -1;
+    if (strcmp(format, "pcm") == 0)
+        profile->format = RSF_FORMAT_PCM;
+    else if (strcmp(format, "adpcm") == 0)
+        profile->format = RSF_FORMAT_ADPCM;
+    else
         return -1;
+    if (snprintf(profile->name, sizeof(profile->name), "%s_%d%s", name, profile->rate,
+                 profile->format == RSF_FORMAT_ADPCM ? "a" : "") >= (int)sizeof(profile->name))
+        return -1;
+    return 0;
+}
+
+// Check for an EV3 id such as 00:16:53:56:55:D9
+int is_bt_id(const char *arg)
+{
+    if (strlen(arg) != 17)
+        return 0;
+    for (int i = 0; i < 17; i += 1)
+        if (i % 3 == 2 ? arg[i] != ':' : !isxdigit(arg[i]))
+            return 0;
+    return 1;
+}
+
+// Queue the shared segments of a track that the EV3 does not have yet,
+// followed by its manifest
+void upload_shared(const char *track)
+{
+    char segments[MAX_SEGMENTS][RSF_SHARED_NAME], path[1024], entry[64];
+    int dir_len = strrchr(track, '/') == NULL ? 0 : strrchr(track, '/') - track + 1;
+    int segment_cnt = rsf_read_manifest(track, segments, MAX_SEGMENTS);
+
+    for (int i = 0; i < segment_cnt; i += 1)
+    {
+        int found = 0;
+        snprintf(entry, sizeof(entry), " %s.rsf\n", segments[i]);
+        if (listing != NULL && strstr(listing, entry) != NULL)
+            found = 1;
+        for (int k = 0; k < uploaded_cnt && !found; k += 1)
+            found = strcmp(uploaded[k], segments[i]) == 0;
+        if (found)
+        {
+            debug("Segment #%d is already on the EV3.\n", i + 1);
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%.*s%s.rsf", dir_len, track, segments[i]) >= (int)sizeof(path))
+        {
+            debug("Error: Path too long for %s.\n", segments[i]);
+            continue;
+        }
+        queue_upload(path);
+        if (uploaded_cnt < MAX_SEGMENTS)
+            strcpy(uploaded[uploaded_cnt++], segments[i]);
     }
-    strcpy(name, argv[1]);
-    int name_len = strlen(name);
-    int dot = name_len - 1;
-    while (dot >= 0 && name[dot] != '.')
-        dot -= 1;
-    if (dot < 0)
-        dot = name_len;
-    name[dot] = 0;
-    sprintf(str, "ffmpeg -i %s -acodec pcm_u8 -f u8 -ac 1 -ar 8000 %s.raw", argv[1], name);
-    if (system(str) != 0)
+    if (snprintf(path, sizeof(path), "%s.lst", track) < (int)sizeof(path))
+        queue_upload(path);
+}
+
+// Delete the segments of a track that a longer earlier version left on the
+// EV3, all in one batch. Listing lines end in the file name.
+void remove_stale(const char *track, int segment_cnt)
+{
+    struct BT_batch batch;
+    char path[1024];
+    const char *base = strrchr(track, '/');
+    base = base == NULL ? track : base + 1;
+    int len = strlen(base), k, n;
+
+    BT_batch_init(&batch);
+    char *line = listing;
+    while (line != NULL && *line != 0)
     {
-        debug("Error: Cannot convert the sound file to .raw file.\n");
-        debug("Please check the file name, and whether ffmpeg is correctly installed.\n");
-        return -1;
+        char *end = line + strcspn(line, "\n");
+        char *file = end;
+        while (file > line && file[-1] != ' ')
+            file -= 1;
+        int file_len = end - file;
+        if (file_len > len + 5 && strncmp(file, base, len) == 0 && file[len] == '_' &&
+            strncmp(end - 4, ".rsf", 4) == 0 && sscanf(file + len + 1, "%d%n", &k, &n) == 1 &&
+            len + 1 + n == file_len - 4 && k > segment_cnt)
+        {
+            if (snprintf(path, sizeof(path), RSF_SOUND_DIR "%.*s", file_len, file) < (int)sizeof(path))
+                BT_batch_delete_file(&batch, path);
+        }
+        line = *end == '\n' ? end + 1 : NULL;
     }
-    sprintf(str, "%s.raw", name);
-    int in_fd = open(str, O_RDONLY);
-    if (in_fd < 0)
+    if (batch.cnt > 0)
     {
-        debug("Error: Cannot open .raw file.\n");
-        return -1;
+        debug("Deleting %d old segments from the EV3...\n", batch.cnt);
+        if (BT_batch_run(&batch, BT_BATCH_WINDOW) != 0)
+            debug("Warning: Some old segments could not be deleted.\n");
     }
-    int segment_cnt = 0, size;
-    while ((size = read(in_fd, buffer, sizeof(buffer))) > 0)
+    BT_batch_free(&batch);
+}
+
+// Delete the shared segments on the EV3 that none of its manifests lists any
+// more, once the new manifests are there. The manifests are read from their
+// local copies next to the tracks converted; if the EV3 has one that is not
+// there, it holds tracks from elsewhere and nothing is deleted.
+void remove_orphans(char const *tracks[], int track_cnt)
+{
+    char segments[MAX_SEGMENTS][RSF_SHARED_NAME], (*used)[RSF_SHARED_NAME] = NULL, file[1024], path[2100];
+    int used_cnt = 0, used_max = 0, cnt;
+    struct BT_batch batch;
+
+    BT_batch_init(&batch);
+    for (int pass = 0; pass < 2; pass += 1)
     {
-        segment_cnt += 1;
-        sprintf(str, "%s_%d.rsf", name, segment_cnt);
-        int out_fd = open(str, O_CREAT | O_WRONLY, 0644);
-        if (out_fd < 0)
+        char *line = listing;
+        while (line != NULL && *line != 0)
         {
-            debug("Error: Cannot open output file.\n");
-            close(in_fd);
+            char *end = line + strcspn(line, "\n"), *start = end;
+            while (start > line && start[-1] != ' ')
+                start -= 1;
+            int len = end - start < (int)sizeof(file) ? end - start : 0;
+            memcpy(file, start, len);
+            file[len] = 0;
+            line = *end == '\n' ? end + 1 : NULL;
+
+            // First the names every manifest uses, then the shared segments
+            // that none of them uses
+            if (pass == 0 && len > 4 && strcmp(file + len - 4, ".lst") == 0)
+            {
+                cnt = -1;
+                for (int t = 0; t < track_cnt && cnt < 0; t += 1)
+                {
+                    const char *slash = strrchr(tracks[t], '/');
+                    int dir_len = slash == NULL ? 0 : slash - tracks[t] + 1;
+                    snprintf(path, sizeof(path), "%.*s%.*s", dir_len, tracks[t], len - 4, file);
+                    cnt = rsf_read_manifest(path, segments, MAX_SEGMENTS);
+                }
+                if (cnt < 0)
+                {
+                    debug("Keeping unused shared segments on the EV3, %s is not here.\n", file);
+                    free(used);
+                    BT_batch_free(&batch);
+                    return;
+                }
+                if (used_cnt + cnt > used_max)
+                {
+                    used_max = 2 * (used_cnt + cnt);
+                    void *grown = realloc(used, used_max * sizeof(*used));
+                    if (grown == NULL)
+                    {
+                        free(used);
+                        BT_batch_free(&batch);
+                        return;
+                    }
+                    used = grown;
+                }
+                memcpy(used[used_cnt], segments, cnt * sizeof(*used));
+                used_cnt += cnt;
+            }
+            else if (pass == 1 && rsf_is_shared(file))
+            {
+                file[len - 4] = 0;
+                int found = 0;
+                for (int k = 0; k < used_cnt && !found; k += 1)
+                    found = strcmp(used[k], file) == 0;
+                if (!found && snprintf(path, sizeof(path), RSF_SOUND_DIR "%s.rsf", file) < (int)sizeof(path))
+                    BT_batch_delete_file(&batch, path);
+            }
+        }
+    }
+    if (batch.cnt > 0)
+    {
+        debug("Deleting %d unused shared segments from the EV3...\n", batch.cnt);
+        if (BT_batch_run(&batch, BT_BATCH_WINDOW) != 0)
+            debug("Warning: Some unused shared segments could not be deleted.\n");
+    }
+    free(used);
+    BT_batch_free(&batch);
+}
+
+int main(int argc, char const *argv[])
+{
+    int profile_cnt = 0, share = 0, wifi = 0, opt;
+    double peak = 0;
+    const char *profile_args[MAX_PROFILES];
+    const char *bt_id = NULL;
+
+    while ((opt = getopt(argc, (char *const *)argv, "dnp:w")) != -1)
+    {
+        if (opt == 'd')
+            share = 1;
+        else if (opt == 'n')
+            peak = NORMALIZE_PEAK;
+        else if (opt == 'w')
+            wifi = 1;
+        else if (opt == 'p' && profile_cnt < MAX_PROFILES)
+            profile_args[profile_cnt++] = optarg;
+        else
+        {
+            debug("Usage: %s [-d] [-n] [-w] [-p rate[:pcm|adpcm]]... file... [EV3 id]\n", argv[0]);
             return -1;
         }
-        str[0] = 0x01;
-        str[1] = 0x00;
-        str[2] = size >> 8;
-        str[3] = size & ((1 << 8) - 1);
-        str[4] = 0x1f;
-        str[5] = 0x40;
-        str[6] = 0x00;
-        str[7] = 0x00;
-        write(out_fd, str, 8);
-        write(out_fd, buffer, size);
-        close(out_fd);
     }
-    close(in_fd);
-    if (argc == 3)
+    int file_cnt = argc - optind;
+    if (file_cnt >= 2 && is_bt_id(argv[argc - 1]))
     {
-        if (BT_open(argv[2]) != 0)
+        bt_id = argv[argc - 1];
+        file_cnt -= 1;
+    }
+    if (file_cnt < 1)
+    {
+        debug("Error: Invalid argc!\n");
+        return -1;
+    }
+    if (bt_id != NULL)
+    {
+        if (BT_open(bt_id) != 0)
         {
             debug("Error: Cannot connect to EV3.\n");
             return -1;
         }
-        for (int i = 1; i <= segment_cnt; i += 1)
+        // The whole listing, however many replies it takes
+        int status = BT_list_files(RSF_SOUND_DIR, &listing);
+        if (status != SUCCESS && status != END_OF_FILE)
+            listing = NULL;
+    }
+
+    for (int f = optind; f < optind + file_cnt; f += 1)
+    {
+        int cnt = profile_cnt;
+        if (strlen(argv[f]) >= sizeof(name))
+        {
+            debug("Error: Path too long for %s.\n", argv[f]);
+            continue;
+        }
+        rsf_base_name(name, argv[f]);
+        for (int i = 0; i < profile_cnt; i += 1)
         {
-            debug("Uploading segment #%d...\n", i);
-            char *str2 = str + sizeof(str) / 2;
-            sprintf(str2, "%s_%d.rsf", name, i);
-            sprintf(str, "/home/root/lms2012/prjs/sound/%s", str2);
-            debug("%s\n%s\n", str, str2);
-            BT_upload_file(str, str2);
+            if (parse_profile(profile_args[i], &profiles[i]) != 0)
+            {
+                debug("Error: Invalid profile %s.\n", profile_args[i]);
+                return -1;
+            }
+            // Two threads would write the same name_<rate> segments at once
+            for (int k = 0; k < i; k += 1)
+            {
+                if (profiles[k].rate == profiles[i].rate && profiles[k].format == profiles[i].format)
+                {
+                    debug("Error: Profiles %s and %s are the same.\n", profile_args[k], profile_args[i]);
+                    return -1;
+                }
+            }
         }
+        if (cnt == 0)
+        {
+            profiles[0].rate = RSF_SAMPLE_RATE;
+            profiles[0].format = RSF_FORMAT_PCM;
+            strcpy(profiles[0].name, name);
+            cnt = 1;
+        }
+        if (rsf_convert_profiles(argv[f], profiles, cnt, peak) != 0)
+            return -1;
+        for (int p = 0; p < cnt; p += 1)
+        {
+            if (share && rsf_share_segments(profiles[p].name, profiles[p].segment_cnt) != 0)
+                return -1;
+            if (bt_id != NULL && share)
+                upload_shared(profiles[p].name);
+            for (int i = 1; bt_id != NULL && !share && i <= profiles[p].segment_cnt; i += 1)
+            {
+                char path[1100];
+                snprintf(path, sizeof(path), "%s_%d.rsf", profiles[p].name, i);
+                queue_upload(path);
+            }
+            if (bt_id != NULL && !share)
+                remove_stale(profiles[p].name, profiles[p].segment_cnt);
+            free(profiles[p].changed);
+        }
+    }
+    if (bt_id != NULL)
+    {
+        debug("Uploading %d files...\n", queue_cnt);
+        if (rsf_upload_all(bt_id, (const char **)queue, queue_cnt, wifi) != 0)
+            debug("Error: Some files could not be uploaded.\n");
+        else if (share)
+            remove_orphans(argv + optind, file_cnt);
+        for (int i = 0; i < queue_cnt; i += 1)
+            free(queue[i]);
+        free(queue);
+        free(listing);
+        rsf_save_link(bt_id);
         BT_close();
     }
     return 0;
-}
\ No newline at end of file
+}
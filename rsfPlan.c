@@ -0,0 +1,133 @@
+#include "EV3_RobotControl/btcomm.h"
+#include "rsf.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_FILES 1024
+#define MAX_PROFILES 8
+
+struct plan
+{
+    int rate, format;
+    long segments, bytes;
+    double seconds;
+};
+
+// Settings tried when no -p is given, from the best sound to the smallest
+struct plan candidates[MAX_PROFILES] = {
+    {8000, RSF_FORMAT_PCM, 0, 0, 0},
+    {6000, RSF_FORMAT_PCM, 0, 0, 0},
+    {8000, RSF_FORMAT_ADPCM, 0, 0, 0},
+    {4000, RSF_FORMAT_PCM, 0, 0, 0},
+    {6000, RSF_FORMAT_ADPCM, 0, 0, 0},
+    {4000, RSF_FORMAT_ADPCM, 0, 0, 0},
+};
+double duration[MAX_FILES];
+struct rsf_link profile;
+
+// Parse a "rate[:pcm|adpcm]" setting as rsfConverter does
+int parse_profile(const char *arg, struct plan *plan)
+{
+    char format[16] = "pcm";
+    if (sscanf(arg, "%d:%15s", &plan->rate, format) < 1 || plan->rate < 1000 || plan->rate > 65535)
+        return -1;
+    if (strcmp(format, "pcm") == 0)
+        plan->format = RSF_FORMAT_PCM;
+    else if (strcmp(format, "adpcm") == 0)
+        plan->format = RSF_FORMAT_ADPCM;
+    else
+        return -1;
+    return 0;
+}
+
+// Add up the segments, bytes and upload time of a file of the given length.
+// Segments are filled to RSF_MAX_PAYLOAD as rsf_encode() does, so the last
+// one holds the remainder.
+void plan_file(struct plan *plan, double seconds)
+{
+    long samples = (long)(seconds * plan->rate + 0.5);
+    long payload = plan->format == RSF_FORMAT_ADPCM ? (samples + 1) / 2 : samples;
+    if (payload == 0)
+        return;
+    long full = payload / RSF_MAX_PAYLOAD, rest = payload % RSF_MAX_PAYLOAD;
+
+    plan->segments += full + (rest > 0);
+    plan->bytes += payload + RSF_HEADER_SIZE * (full + (rest > 0));
+    plan->seconds += full * rsf_upload_time(&profile, RSF_HEADER_SIZE + RSF_MAX_PAYLOAD);
+    if (rest > 0)
+        plan->seconds += rsf_upload_time(&profile, RSF_HEADER_SIZE + rest);
+}
+
+int main(int argc, char const *argv[])
+{
+    int cnt = 6, profile_cnt = 0, opt;
+    double budget = -1, free_kb = -1, total = 0;
+    const char *bt_id = NULL;
+
+    while ((opt = getopt(argc, (char *const *)argv, "b:T:s:p:")) != -1)
+    {
+        if (opt == 'b')
+            bt_id = optarg;
+        else if (opt == 'T')
+            budget = atof(optarg);
+        else if (opt == 's')
+            free_kb = atof(optarg);
+        else if (opt == 'p' && profile_cnt < MAX_PROFILES && parse_profile(optarg, &candidates[profile_cnt]) == 0)
+            profile_cnt += 1;
+        else
+        {
+            debug("Usage: %s [-b EV3 id] [-T budget_seconds] [-s free_kb] [-p rate[:pcm|adpcm]]... file...\n", argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > MAX_FILES)
+    {
+        debug("Error: Invalid argc!\n");
+        return -1;
+    }
+    if (profile_cnt > 0)
+        cnt = profile_cnt;
+
+    if (rsf_load_link(bt_id == NULL ? "" : bt_id, &profile) == 0)
+        printf("Link to %s: %.0f ms round trip, %.1f KB/s (from %d uploads)\n",
+               bt_id, profile.rtt * 1000, profile.throughput / 1024, profile.uploads);
+    else
+        printf("Link not measured yet, assuming %.0f ms round trip, %.1f KB/s\n",
+               profile.rtt * 1000, profile.throughput / 1024);
+
+    // Only the durations are needed, which ffprobe reads from the headers
+    for (int f = optind; f < argc; f += 1)
+    {
+        duration[f - optind] = rsf_probe(argv[f]);
+        if (duration[f - optind] < 0)
+        {
+            debug("Error: Cannot probe %s.\n", argv[f]);
+            return -1;
+        }
+        total += duration[f - optind];
+    }
+    printf("%d files, %.1f s of sound\n\n", argc - optind, total);
+
+    int best = -1;
+    printf("%-8s %6s %9s %11s %10s\n", "format", "rate", "segments", "size (KB)", "upload");
+    for (int p = 0; p < cnt; p += 1)
+    {
+        struct plan *plan = &candidates[p];
+        for (int f = 0; f < argc - optind; f += 1)
+            plan_file(plan, duration[f]);
+        int fits = (budget < 0 || plan->seconds <= budget) && (free_kb < 0 || plan->bytes / 1024.0 <= free_kb);
+        if (fits && best < 0)
+            best = p;
+        printf("%-8s %6d %9ld %11.1f %9.1fs%s\n", plan->format == RSF_FORMAT_ADPCM ? "adpcm" : "pcm", plan->rate,
+               plan->segments, plan->bytes / 1024.0, plan->seconds, fits ? "" : "  (over)");
+    }
+    printf("\n");
+    if (best < 0)
+    {
+        printf("No setting meets the limits.\n");
+        return 1;
+    }
+    printf("Recommended: -p %d:%s\n", candidates[best].rate, candidates[best].format == RSF_FORMAT_ADPCM ? "adpcm" : "pcm");
+    return 0;
+}
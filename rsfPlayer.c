@@ -1,31 +1,245 @@
 #include "EV3_RobotControl/btcomm.h"
+#include "rsf.h"
+#include <poll.h>
+#include <time.h>
 
-#define debug(...) fprintf(stderr, __VA_ARGS__)
+#define MAX_SEGMENTS 1024
 
-char str[1024];
+char str[1100], local[1100];
+char segments[MAX_SEGMENTS][RSF_SHARED_NAME];
+double duration[MAX_SEGMENTS + 1];
+int shared_cnt, tail, volumn;
+const char *name;
+struct rsf_link profile;
+
+// With -t, the rest of the segment after a seek is played as a chain of
+// pieces, each uploaded while the one before it plays. The first is uploaded
+// while the old sound still plays, so the only silence is the time it takes
+// to stop one sound and start the next. Each later piece is as long as the
+// link can deliver before the one playing ends.
+int piece_segment, piece_offset, piece_samples, piece_rate, piece_cnt;
+double piece_seconds; // length of the piece uploaded and waiting, or 0
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Local cached copy of segment i
+void local_segment(int i)
+{
+    int dir_len = strrchr(name, '/') == NULL ? 0 : strrchr(name, '/') - name + 1;
+    if (shared_cnt >= 0)
+        snprintf(local, sizeof(local), "%.*s%s.rsf", dir_len, name, segments[i - 1]);
+    else
+        snprintf(local, sizeof(local), "%s_%d.rsf", name, i);
+}
+
+void play_segment(int i)
+{
+    if (shared_cnt >= 0)
+        snprintf(str, sizeof(str), RSF_SOUND_DIR "%s", segments[i - 1]);
+    else
+        snprintf(str, sizeof(str), RSF_SOUND_DIR "%s_%d", name, i);
+    BT_play_sound_file(str, volumn);
+}
+
+// Bytes of sound the link can deliver in seconds, going by its profile
+long piece_bytes(double seconds)
+{
+    // Each upload costs a round trip to open the file and one per chunk
+    double bytes = (seconds - 2 * profile.rtt) / (profile.rtt / PARTITION_SIZE + 1 / profile.throughput);
+    return bytes > 0 ? (long)bytes : 0;
+}
+
+// Length of the first piece of a chain playing seconds of sound: the shortest
+// from which every next piece can be uploaded while the one before it plays,
+// or all of it if the link is too slow for a chain
+double first_piece(double seconds)
+{
+    for (double first = 0.05; first < seconds; first *= 1.1)
+    {
+        double piece = first, covered = first;
+        for (int k = 0; k < 100 && covered < seconds && piece > 0; k += 1)
+        {
+            piece = (double)piece_bytes(0.8 * piece) / piece_rate;
+            covered += piece;
+        }
+        if (covered >= seconds)
+            return first;
+    }
+    return seconds;
+}
+
+// Cut the next piece of the segment, seconds long, from the local copy and
+// upload it. Pieces alternate between two names so the one playing is never
+// overwritten. Returns 0 on success, or -1 on error.
+int upload_piece(double seconds)
+{
+    // However slow the link turns out to be, keep making progress
+    int count = seconds > 0.05 ? seconds * piece_rate : 0.05 * piece_rate;
+    if (count > piece_samples - piece_offset)
+        count = piece_samples - piece_offset;
+    if (count > RSF_MAX_PAYLOAD)
+        count = RSF_MAX_PAYLOAD;
+
+    local_segment(piece_segment);
+    snprintf(str, sizeof(str), "%s_seek%d.rsf", name, piece_cnt % 2 + 1);
+    if (rsf_write_tail(local, piece_offset, count, str) != 0)
+        return -1;
+    int status = rsf_upload(str);
+    if (status != SUCCESS && status != END_OF_FILE)
+        return -1;
+    piece_offset += count;
+    piece_seconds = (double)count / piece_rate;
+    return 0;
+}
+
+// Play the piece uploaded last. Returns its length in seconds.
+double play_piece()
+{
+    const char *base = strrchr(name, '/');
+    double seconds = piece_seconds;
+    base = base == NULL ? name : base + 1;
+    snprintf(str, sizeof(str), RSF_SOUND_DIR "%s_seek%d", base, piece_cnt % 2 + 1);
+    BT_play_sound_file(str, volumn);
+    piece_cnt += 1;
+    piece_seconds = 0;
+    return seconds;
+}
+
+// While a piece plays, upload as much of the rest of the segment as the link
+// can deliver before it ends
+void next_piece(double end)
+{
+    if (piece_offset == 0 || piece_offset >= piece_samples || piece_seconds > 0)
+        return;
+    if (upload_piece((double)piece_bytes(0.8 * (end - now())) / piece_rate) != 0)
+    {
+        debug("Warning: Cannot upload the rest of segment #%d.\n", piece_segment);
+        piece_offset = 0;
+    }
+}
+
+// Jump to position (in seconds). Stops the current sound and starts the
+// segment containing position; with -t, the first piece of the segment from
+// that position is uploaded before the current sound is stopped, so playback
+// starts at the exact sample. Returns the segment playing and sets end to when
+// it, or the piece of it, will finish.
+int seek(int segment_cnt, double position, double *end)
+{
+    int i = 1, format, size, rate;
+    while (i < segment_cnt && position >= duration[i])
+        position -= duration[i++];
+    if (position < 0)
+        position = 0;
+
+    local_segment(i);
+    piece_offset = 0;
+    piece_seconds = 0;
+    if (tail && position > 0 && rsf_read_header(local, &format, &size, &rate) == 0 && rate > 0)
+    {
+        piece_segment = i;
+        piece_rate = rate;
+        piece_samples = format == RSF_FORMAT_ADPCM ? 2 * size : size;
+        piece_offset = (int)(position * rate);
+        if (piece_offset < piece_samples &&
+            upload_piece(first_piece((double)(piece_samples - piece_offset) / rate)) == 0)
+        {
+            BT_sound_break();
+            *end = now() + play_piece();
+            return i;
+        }
+        piece_offset = 0;
+    }
+    BT_sound_break();
+    debug("Playing segment #%d from its start.\n", i);
+    play_segment(i);
+    *end = now() + duration[i];
+    return i;
+}
 
 int main(int argc, char const *argv[])
 {
-    if (argc != 5)
+    int opt;
+    double start = 0, end;
+
+    while ((opt = getopt(argc, (char *const *)argv, "t")) != -1)
+    {
+        if (opt == 't')
+            tail = 1;
+        else
+        {
+            debug("Usage: %s [-t] EV3_id name n volumn [start_seconds]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind != 4 && argc - optind != 5)
     {
         debug("Error: Invalid argc!\n");
         return -1;
     }
+    argv += optind - 1;
     if (BT_open(argv[1]) != 0)
     {
         debug("Error: Cannot connect to EV3.\n");
         return -1;
     }
-    int segment_cnt, volumn;
+    int segment_cnt;
+    name = argv[2];
+    rsf_load_link(argv[1], &profile);
     sscanf(argv[3], "%d", &segment_cnt);
     sscanf(argv[4], "%d", &volumn);
+    if (argc - optind == 5)
+        sscanf(argv[5], "%lf", &start);
+
+    // Tracks converted with -d play their shared segments listed in name.lst
+    shared_cnt = rsf_read_manifest(name, segments, MAX_SEGMENTS);
+    if (shared_cnt >= 0 && shared_cnt < segment_cnt)
+        segment_cnt = shared_cnt;
+    if (segment_cnt > MAX_SEGMENTS)
+        segment_cnt = MAX_SEGMENTS;
+
+    // Segment lengths come from the local copies, or assume full 8 kHz segments
     for (int i = 1; i <= segment_cnt; i += 1)
     {
-        sprintf(str, "/home/root/lms2012/prjs/sound/%s_%d", argv[2], i);
-        BT_play_sound_file(str, volumn);
-        if (i < segment_cnt)
-            sleep(8);
+        local_segment(i);
+        duration[i] = rsf_duration(local);
+        if (duration[i] < 0)
+            duration[i] = (double)RSF_MAX_PAYLOAD / RSF_SAMPLE_RATE;
+    }
+
+    // Typing a time in seconds while playing seeks to it
+    int i = seek(segment_cnt, start, &end);
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    while (1)
+    {
+        next_piece(end);
+        double left = end - now();
+        int ready = left > 0 ? poll(&pfd, 1, (int)(left * 1000)) : 0;
+        if (ready > 0)
+        {
+            if (fgets(str, sizeof(str), stdin) == NULL)
+                pfd.fd = -1;
+            else if (sscanf(str, "%lf", &start) == 1)
+                i = seek(segment_cnt, start, &end);
+            continue;
+        }
+        if (left > 0.001)
+            continue;
+        if (piece_seconds > 0)
+        {
+            end += play_piece();
+            continue;
+        }
+        if (i == segment_cnt)
+            break;
+        play_segment(++i);
+        end += duration[i];
     }
+    rsf_save_link(argv[1]);
     BT_close();
     return 0;
 }
@@ -0,0 +1,378 @@
+#include "EV3_RobotControl/btcomm.h"
+#include "rsf.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+#define MAX_PENDING 256
+#define MAX_BRICKS 8
+#define MAX_RETRIES 256
+#define RETRY_MS 5000
+
+// Files that changed since the last batch was converted
+char pending[MAX_PENDING][1024];
+int pending_cnt;
+
+// Results of converting pending[i], and the number of segments it had before
+int segment_cnt[MAX_PENDING], old_cnt[MAX_PENDING];
+char *changed[MAX_PENDING];
+
+int next_job;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One uploader process per brick, fed "local\tremote\n" lines through a pipe
+int brick_fd[MAX_BRICKS];
+pid_t brick_pid[MAX_BRICKS];
+int brick_cnt;
+
+// Lines of an uploader that failed, tried again every RETRY_MS while it waits
+// for more and once more before it exits
+char retry[MAX_RETRIES][2200];
+int retry_cnt;
+
+// Counts SIGINT and SIGTERM: the first stops watching and lets the uploaders
+// finish, the second stops them as well
+volatile sig_atomic_t stop;
+
+void on_stop(int sig)
+{
+    (void)sig;
+    stop += 1;
+}
+
+int is_audio(const char *file)
+{
+    static const char *exts[] = {"mp3", "mp4", "m4a", "wav", "ogg", "oga", "opus",
+                                 "flac", "aac", "wma", "aif", "aiff", NULL};
+    const char *dot = strrchr(file, '.');
+    if (file[0] == '.' || dot == NULL)
+        return 0;
+    for (int i = 0; exts[i] != NULL; i += 1)
+        if (strcasecmp(dot + 1, exts[i]) == 0)
+            return 1;
+    return 0;
+}
+
+void add_pending(const char *dir, const char *file)
+{
+    char path[1024], name[1024], other[1024];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path))
+    {
+        debug("Warning: Path too long, ignoring %s.\n", file);
+        return;
+    }
+
+    // song.mp3 and song.wav would both be written to song_1.rsf ..., so only
+    // the file written last is converted
+    rsf_base_name(name, path);
+    for (int i = 0; i < pending_cnt; i += 1)
+    {
+        rsf_base_name(other, pending[i]);
+        if (strcmp(other, name) == 0)
+        {
+            if (strcmp(pending[i], path) != 0)
+                debug("Warning: %s and %s have the same name, converting only %s.\n", pending[i], path, path);
+            strcpy(pending[i], path);
+            return;
+        }
+    }
+    if (pending_cnt == MAX_PENDING)
+    {
+        debug("Warning: Too many pending files, ignoring %s.\n", path);
+        return;
+    }
+    strcpy(pending[pending_cnt++], path);
+}
+
+void *convert_worker(void *arg)
+{
+    char name[1024], path[1100];
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&job_lock);
+        int i = next_job++;
+        pthread_mutex_unlock(&job_lock);
+        if (i >= pending_cnt)
+            return NULL;
+        rsf_base_name(name, pending[i]);
+        old_cnt[i] = 0;
+        do
+            snprintf(path, sizeof(path), "%s_%d.rsf", name, ++old_cnt[i]);
+        while (access(path, F_OK) == 0);
+        old_cnt[i] -= 1;
+        segment_cnt[i] = rsf_convert(pending[i], name, &changed[i]);
+    }
+}
+
+// Carry out one "local\tremote" line: upload local to remote, or delete
+// remote if local is empty. Returns 0 when done, or -1 if it should be tried
+// again; the connection is then dropped, so the next attempt opens a new one.
+int send_line(const char *bt_id, const char *line, int *connected)
+{
+    char local[2200];
+    int status;
+
+    snprintf(local, sizeof(local), "%s", line);
+    char *remote = strchr(local, '\t');
+    if (remote == NULL)
+        return 0;
+    *remote++ = 0;
+    if (!*connected && BT_open(bt_id) != 0)
+    {
+        debug("Error: Cannot connect to EV3 %s.\n", bt_id);
+        return -1;
+    }
+    *connected = 1;
+    if (local[0] == 0)
+    {
+        // No local file: a segment the new version no longer has. Only a
+        // failed link is worth another try, not a file that is already gone
+        debug("[%s] Deleting %s...\n", bt_id, remote);
+        status = BT_delete_file(remote);
+        if (status >= 0)
+            return 0;
+    }
+    else
+    {
+        // A damaged file is sent again once it has been rewritten
+        debug("[%s] Uploading %s...\n", bt_id, local);
+        status = rsf_upload_to(local, remote);
+        if (status == SUCCESS || status == END_OF_FILE || status == CORRUPT_FILE)
+            return 0;
+    }
+    debug("Warning: [%s] Sending %s failed, trying again later.\n", bt_id, remote);
+    BT_close();
+    *connected = 0;
+    return -1;
+}
+
+// Remember or forget a failed line. A newer line for the same remote file
+// replaces the older one.
+void set_retry(const char *line, int failed)
+{
+    const char *remote = strchr(line, '\t');
+    int i = 0;
+    while (i < retry_cnt && strcmp(strchr(retry[i], '\t'), remote) != 0)
+        i += 1;
+    if (!failed)
+    {
+        if (i < retry_cnt)
+        {
+            retry_cnt -= 1;
+            memmove(retry[i], retry[i + 1], (retry_cnt - i) * sizeof(retry[0]));
+        }
+        return;
+    }
+    if (i == MAX_RETRIES)
+    {
+        debug("Warning: Too many failed uploads, giving up on %s.\n", remote + 1);
+        return;
+    }
+    snprintf(retry[i], sizeof(retry[i]), "%s", line);
+    retry_cnt += i == retry_cnt;
+}
+
+// Try the failed lines again in order, stopping at the first that fails
+void send_retries(const char *bt_id, int *connected)
+{
+    char line[2200];
+    while (retry_cnt > 0)
+    {
+        snprintf(line, sizeof(line), "%s", retry[0]);
+        if (send_line(bt_id, line, connected) != 0)
+            return;
+        set_retry(line, 0);
+    }
+}
+
+void uploader(const char *bt_id, int fd)
+{
+    char line[2200];
+    int connected;
+
+    // Ctrl-C reaches the whole process group; the uploader stops when main()
+    // closes its pipe instead, so it can save the link timings first
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    connected = BT_open(bt_id) == 0;
+    if (!connected)
+        debug("Error: Cannot connect to EV3 %s, trying again with each upload.\n", bt_id);
+
+    // Unbuffered, so that poll() sees every line not read yet
+    FILE *in = fdopen(fd, "r");
+    setvbuf(in, NULL, _IONBF, 0);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    for (;;)
+    {
+        if (retry_cnt > 0 && poll(&pfd, 1, RETRY_MS) == 0)
+        {
+            send_retries(bt_id, &connected);
+            continue;
+        }
+        if (fgets(line, sizeof(line), in) == NULL)
+            break;
+        line[strcspn(line, "\n")] = 0;
+        if (strchr(line, '\t') != NULL)
+            set_retry(line, send_line(bt_id, line, &connected) != 0);
+    }
+    send_retries(bt_id, &connected);
+    for (int i = 0; i < retry_cnt; i += 1)
+        debug("Warning: [%s] %s was not updated on the EV3.\n", bt_id, strchr(retry[i], '\t') + 1);
+    rsf_save_link(bt_id);
+    if (connected)
+        BT_close();
+    exit(retry_cnt > 0 ? -1 : 0);
+}
+
+// Send segment i of name to the bricks, or delete it there if stale
+void push_segment(const char *name, int i, int stale)
+{
+    char line[2200];
+    const char *base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+    int len = stale ? snprintf(line, sizeof(line), "\t" RSF_SOUND_DIR "%s_%d.rsf\n", base, i)
+                    : snprintf(line, sizeof(line), "%s_%d.rsf\t" RSF_SOUND_DIR "%s_%d.rsf\n", name, i, base, i);
+    for (int b = 0; b < brick_cnt; b += 1)
+        write(brick_fd[b], line, len);
+}
+
+void convert_pending(int jobs)
+{
+    pthread_t threads[jobs];
+    char name[1024];
+
+    next_job = 0;
+    for (int t = 0; t < jobs; t += 1)
+        pthread_create(&threads[t], NULL, convert_worker, NULL);
+    for (int t = 0; t < jobs; t += 1)
+        pthread_join(threads[t], NULL);
+
+    for (int i = 0; i < pending_cnt; i += 1)
+    {
+        if (segment_cnt[i] < 0)
+            continue;
+        rsf_base_name(name, pending[i]);
+        int cnt = 0;
+        for (int s = 1; s <= segment_cnt[i]; s += 1)
+        {
+            if (changed[i][s - 1])
+            {
+                push_segment(name, s, 0);
+                cnt += 1;
+            }
+        }
+        for (int s = segment_cnt[i] + 1; s <= old_cnt[i]; s += 1)
+            push_segment(name, s, 1);
+        debug("%s: %d segments, %d changed, %d removed\n", pending[i], segment_cnt[i], cnt,
+              old_cnt[i] > segment_cnt[i] ? old_cnt[i] - segment_cnt[i] : 0);
+        free(changed[i]);
+    }
+    pending_cnt = 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    int jobs = 4, debounce = 300, opt;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while ((opt = getopt(argc, (char *const *)argv, "j:t:")) != -1)
+    {
+        if (opt == 'j')
+            jobs = atoi(optarg);
+        else if (opt == 't')
+            debounce = atoi(optarg);
+        else
+        {
+            debug("Usage: %s [-j jobs] [-t debounce_ms] dir [EV3 id ...]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (optind >= argc || jobs < 1 || debounce < 0 || argc - optind - 1 > MAX_BRICKS)
+    {
+        debug("Error: Invalid argc!\n");
+        return -1;
+    }
+    const char *dir = argv[optind];
+
+    int in_fd = inotify_init1(IN_CLOEXEC);
+    if (in_fd < 0 || inotify_add_watch(in_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        debug("Error: Cannot watch %s.\n", dir);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    for (int i = optind + 1; i < argc; i += 1)
+    {
+        int fds[2];
+        pipe(fds);
+        brick_pid[brick_cnt] = fork();
+        if (brick_pid[brick_cnt] == 0)
+        {
+            // Only main() may hold the other uploaders' pipes, or closing
+            // them would not stop those uploaders
+            for (int b = 0; b < brick_cnt; b += 1)
+                close(brick_fd[b]);
+            close(fds[1]);
+            uploader(argv[i], fds[0]);
+        }
+        close(fds[0]);
+        brick_fd[brick_cnt++] = fds[1];
+    }
+
+    debug("Watching %s...\n", dir);
+    struct pollfd pfd = {in_fd, POLLIN, 0};
+    while (!stop)
+    {
+        // Wait until no event has arrived for a whole debounce period, so a
+        // burst of writes to the same files is converted only once
+        int ready = poll(&pfd, 1, pending_cnt > 0 ? debounce : -1);
+        if (ready < 0)
+            break;
+        if (ready == 0)
+        {
+            convert_pending(jobs);
+            continue;
+        }
+        int len = read(in_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            break;
+        for (char *p = buffer; p < buffer + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && is_audio(event->name))
+                add_pending(dir, event->name);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (brick_cnt > 0)
+        debug("Finishing the uploads, press Ctrl-C again to stop them...\n");
+    for (int b = 0; b < brick_cnt; b += 1)
+        close(brick_fd[b]);
+    for (int b = 0; b < brick_cnt; b += 1)
+    {
+        // The handler is installed without SA_RESTART, so a second signal
+        // interrupts the wait
+        while (waitpid(brick_pid[b], NULL, 0) < 0 && errno == EINTR)
+        {
+            if (stop > 1)
+                for (int k = b; k < brick_cnt; k += 1)
+                    kill(brick_pid[k], SIGKILL);
+        }
+    }
+    close(in_fd);
+    return 0;
+}